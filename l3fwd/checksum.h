@@ -49,19 +49,77 @@ uint16_t checksum(uint32_t sum, const void *data, int nr_bytes)
 	return ~sum;
 }
 
+/*
+* Name : checksum_mbuf
+* Desciption : Same as checksum() for nr_bytes of packet data starting at
+*	offset off of the segment chain m. A 16 bit word may straddle two
+*	segments, an odd last byte is padded with zero.
+*/
+static inline
+uint16_t checksum_mbuf(uint32_t sum, const struct rte_mbuf *m, uint32_t off,
+	uint32_t nr_bytes)
+{
+	union {
+		uint8_t b[2];
+		uint16_t w;
+	} split;
+	const uint8_t *p;
+	uint32_t len;
+	int pending = 0;
+
+	while (m != NULL && off >= m->pkt.data_len) {
+		off -= m->pkt.data_len;
+		m = m->pkt.next;
+	}
+
+	for (; m != NULL && nr_bytes != 0; m = m->pkt.next, off = 0) {
+		p = (const uint8_t *)m->pkt.data + off;
+		len = m->pkt.data_len - off;
+		if (len > nr_bytes)
+			len = nr_bytes;
+		nr_bytes -= len;
+
+		if (pending && len != 0) {
+			split.b[1] = *p++;
+			sum += split.w;
+			pending = 0;
+			len--;
+		}
+		for (; len > 1; len -= 2, p += 2)
+			sum += *(const uint16_t *)p;
+		if (len) {
+			split.b[0] = *p;
+			pending = 1;
+		}
+	}
+
+	if (pending) {
+		split.b[1] = 0;
+		sum += split.w;
+	}
+
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+	return ~sum;
+}
+
 /* 
 * Name : compute_checksum
 * Desciption : Computes TCP/UDP checksum depending on the ip->proto field.
+*	The payload may span several segments, the transport header must be
+*	in the first one.
 * Params :
 *	ipv6_hdr - pointer to the ipv6_hdr
-*	hdr      - Transport header(TCP/UDP)
+*	m        - the packet
+*	l4_off   - offset of the transport header(TCP/UDP) in the packet
 * Returns : None	    	
 */
 static inline
-void compute_checksum(struct ipv6_hdr *ip, void *hdr)
+void compute_checksum(struct ipv6_hdr *ip, struct rte_mbuf *m, uint32_t l4_off)
 {
+	void *hdr = (uint8_t *)m->pkt.data + l4_off;
 	uint16_t *p;
-	uint32_t sum;
+	uint32_t sum = 0;
 	int bytes;
 	struct pseudo_iphdr pip;
 	pip.payload_len = (ip->payload_len);
@@ -77,7 +135,7 @@ void compute_checksum(struct ipv6_hdr *ip, void *hdr)
 
 	p = (uint16_t*)&pip;
 
-	for (bytes =0; bytes< 20; bytes++) {
+	for (bytes = 0; bytes < (int)(sizeof(pip) / sizeof(*p)); bytes++) {
 		sum += p[bytes];
 	}
 
@@ -85,12 +143,12 @@ void compute_checksum(struct ipv6_hdr *ip, void *hdr)
 	{
 		struct udp_header *udp = (struct udp_header *)hdr;
 		udp->csum = 0;
-		udp->csum = checksum(sum, udp, ntohs(ip->payload_len));
+		udp->csum = checksum_mbuf(sum, m, l4_off, ntohs(ip->payload_len));
 	}
 	else
 	{
 		struct tcp_header *tcp = (struct tcp_header *)hdr;
 		tcp->csum = 0;
-		tcp->csum = checksum(sum, tcp, ntohs(ip->payload_len));
+		tcp->csum = checksum_mbuf(sum, m, l4_off, ntohs(ip->payload_len));
 	}
 }
@@ -41,8 +41,11 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <tmmintrin.h>
+#include <immintrin.h>
 #include <rte_common.h>
 #include <rte_byteorder.h>
 #include <rte_log.h>
@@ -55,11 +58,13 @@
 #include <rte_launch.h>
 #include <rte_atomic.h>
 #include <rte_cycles.h>
+#include <rte_cpuflags.h>
 #include <rte_prefetch.h>
 #include <rte_lcore.h>
 #include <rte_per_lcore.h>
 #include <rte_branch_prediction.h>
 #include <rte_interrupts.h>
+#include <rte_alarm.h>
 #include <rte_pci.h>
 #include <rte_random.h>
 #include <rte_debug.h>
@@ -68,17 +73,18 @@
 #include <rte_ring.h>
 #include <rte_mempool.h>
 #include <rte_mbuf.h>
+#include <rte_malloc.h>
 #include <rte_ip.h>
 #include <rte_tcp.h>
 #include <rte_udp.h>
 #include <rte_string_fns.h>
+#include <rte_power.h>
 
 #include "main.h"
 #include "checksum.h"
 
 #define APP_LOOKUP_EXACT_MATCH          0
 #define APP_LOOKUP_LPM                  1
-#define DO_RFC_1812_CHECKS
 
 #ifndef APP_LOOKUP_METHOD
 #define APP_LOOKUP_METHOD             APP_LOOKUP_EXACT_MATCH
@@ -86,6 +92,17 @@
 
 #define ENABLE_MULTI_BUFFER_OPTIMIZE	1
 
+/*
+ * The 8-wide kernels are compiled for AVX2 with a function target attribute
+ * so that one binary can pick them at run time, this needs GCC 4.9 or later
+ * unless the whole build already targets AVX2.
+ */
+#if defined(__AVX2__) || (defined(__GNUC__) && !defined(__INTEL_COMPILER) && \
+	!defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define L3FWD_AVX2_KERNELS
+#define __l3fwd_avx2 __attribute__((target("avx2")))
+#endif
+
 #if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
 #include <rte_hash.h>
 #elif (APP_LOOKUP_METHOD == APP_LOOKUP_LPM)
@@ -116,20 +133,17 @@
 
 #define MEMPOOL_CACHE_SIZE 256
 
-#define MBUF_SIZE (2048 + sizeof(struct rte_mbuf) + RTE_PKTMBUF_HEADROOM)
+#define MBUF_DATA_SIZE_DEFAULT 2048
 
 /*
- * This expression is used to calculate the number of mbufs needed depending on user input, taking
- *  into account memory for rx and tx hardware rings, cache per lcore and mtable per port per lcore.
- *  RTE_MAX is used to ensure that NB_MBUF never goes below a minimum value of 8192
+ * Data room of the mbufs, sized for the largest frame so that frames
+ * arrive in one segment, unless --mbuf-seg-size caps it, see
+ * init_mbuf_size().
  */
+static uint32_t mbuf_data_size = MBUF_DATA_SIZE_DEFAULT;
+static uint32_t mbuf_seg_size = 0; /**< cap from --mbuf-seg-size, 0 for none */
 
-#define NB_MBUF RTE_MAX	(																	\
-				(nb_ports*nb_rx_queue*RTE_TEST_RX_DESC_DEFAULT +							\
-				nb_ports*nb_lcores*MAX_PKT_BURST +											\
-				nb_ports*n_tx_queue*RTE_TEST_TX_DESC_DEFAULT +								\
-				nb_lcores*MEMPOOL_CACHE_SIZE),												\
-				(unsigned)8192)
+#define MBUF_SIZE (mbuf_data_size + sizeof(struct rte_mbuf) + RTE_PKTMBUF_HEADROOM)
 
 /*
  * RX and TX Prefetch, Host, and Write-back threshold values should be
@@ -140,6 +154,7 @@
 #define RX_PTHRESH 8 /**< Default values of RX prefetch threshold reg. */
 #define RX_HTHRESH 8 /**< Default values of RX host threshold reg. */
 #define RX_WTHRESH 4 /**< Default values of RX write-back threshold reg. */
+#define RX_FREE_THRESH 32
 
 /*
  * These default values are optimized for use with the Intel(R) 82599 10 GbE
@@ -153,6 +168,39 @@
 #define MAX_PKT_BURST     32
 #define BURST_TX_DRAIN_US 100 /* TX drain every ~100us */
 
+/*
+ * Partial TX buffers are sent at the latest tx_drain_us after the previous
+ * drain, and right away after an RX poll round that brought fewer than
+ * tx_flush_thresh packets: at low load nothing more is coming to fill them.
+ * A higher threshold favours latency, 0 leaves only the timer.
+ */
+static uint32_t tx_drain_us = BURST_TX_DRAIN_US;
+static uint32_t tx_flush_thresh = MAX_PKT_BURST / 4;
+
+/*
+ * What to do with the packets a full TX queue did not take:
+ * - drop: free them right away (default).
+ * - retry: send the rest again for up to tx_retry_us, then drop.
+ * - hold: keep them in the port's TX buffer for the next flush, packets
+ *   that do not fit in the buffer any more are dropped.
+ */
+enum tx_policy {
+	TX_POLICY_DROP = 0,
+	TX_POLICY_RETRY,
+	TX_POLICY_HOLD,
+	TX_POLICY_MAX
+};
+
+static const char *tx_policy_name[TX_POLICY_MAX] = {
+	"drop", "retry", "hold"
+};
+
+#define TX_RETRY_US 10
+
+static enum tx_policy tx_policy = TX_POLICY_DROP;
+static uint32_t tx_retry_us = TX_RETRY_US;
+static uint64_t tx_retry_tsc; /**< tx_retry_us in TSC cycles */
+
 #define NB_SOCKETS 8
 
 /* Configure how many packets ahead to prefetch, when reading packets */
@@ -163,9 +211,46 @@
  */
 #define RTE_TEST_RX_DESC_DEFAULT 128
 #define RTE_TEST_TX_DESC_DEFAULT 512
+#define MIN_RING_DESC 32
+#define MAX_RING_DESC 4096
 static uint16_t nb_rxd = RTE_TEST_RX_DESC_DEFAULT;
 static uint16_t nb_txd = RTE_TEST_TX_DESC_DEFAULT;
 
+/*
+ * Ring calibration, set with --calibrate-rings: before forwarding, the
+ * master lcore sends synthetic frames out of every port for CALIBRATE_MS
+ * with each candidate of ring_calibration[], and receives them back on
+ * all the RX queues, see calibrate_rings_run(). The ports must be
+ * cross-connected or looped back, with -P: the frames are addressed to
+ * 02:00:00:00:00:<port> like the forwarded ones. The candidate that received
+ * the most packets is kept, or among those within CALIBRATE_TOLERANCE
+ * percent of it, the one the NICs missed the fewest packets with.
+ */
+#define CALIBRATE_MS 100
+#define CALIBRATE_TOLERANCE 2 /**< percent of the best rate */
+#define CALIBRATE_FLOWS 256   /**< source addresses, for RSS to spread */
+#define CALIBRATE_FRAME_LEN 60 /**< without CRC */
+
+struct ring_config {
+	uint16_t nb_rxd;
+	uint16_t rx_free_thresh;
+	uint16_t nb_txd;
+};
+
+static int calibrate_rings = 0;
+static struct ring_config ring_calibration[] = {
+	{0, 0, 0}, /* the command line configuration, see init_ring_calibration() */
+	{128, 32, 512},
+	{256, 32, 512},
+	{256, 64, 1024},
+	{512, 32, 1024},
+	{512, 64, 1024},
+	{1024, 64, 1024},
+};
+
+#define NB_RING_CALIBRATION \
+	(sizeof(ring_calibration) / sizeof(ring_calibration[0]))
+
 /* ethernet addresses of ports */
 static struct ether_addr ports_eth_addr[RTE_MAX_ETHPORTS];
 
@@ -174,6 +259,158 @@ static uint32_t enabled_port_mask = 0;
 static int promiscuous_on = 0; /**< Ports set in promiscuous mode off by default. */
 static int numa_on = 1; /**< NUMA is enabled by default. */
 
+/*
+ * Placement of the lookup tables:
+ * - replicated: one full copy per socket, read locally (default).
+ * - shared: a single copy on the master lcore's socket used by all lcores.
+ * - cached: the shared copy fronted by a flow cache private to each lcore
+ *   (exact match only).
+ */
+enum table_policy {
+	TABLE_POLICY_REPLICATED = 0,
+	TABLE_POLICY_SHARED,
+	TABLE_POLICY_CACHED,
+	TABLE_POLICY_MAX
+};
+
+static const char *table_policy_name[TABLE_POLICY_MAX] = {
+	"replicated", "shared", "cached"
+};
+
+static enum table_policy table_policy = TABLE_POLICY_REPLICATED;
+
+/*
+ * Features the forwarding loop is specialized for, each lcore runs the
+ * variant compiled for the flags in effect, see select_fwd_variants().
+ */
+#define FWD_F_IPV4    0x1 /**< forward IPv4 packets */
+#define FWD_F_IPV6    0x2 /**< forward IPv6 packets */
+#define FWD_F_NAT     0x4 /**< apply the IPv6 NAT rules (exact match only) */
+#define FWD_F_RFC1812 0x8 /**< RFC 1812 checks, TTL and hop limit update */
+#define FWD_F_MAX     0x10
+
+static unsigned fwd_flags = FWD_F_IPV4 | FWD_F_IPV6 | FWD_F_NAT | FWD_F_RFC1812;
+static uint16_t rx_burst_size = MAX_PKT_BURST; /**< packets per RX poll */
+/* gather the RX queues of an lcore into one burst, see l3fwd_rx_coalesced() */
+static int rx_coalesce = 0;
+
+/*
+ * Pipeline mode, set with --worker-lcores: the lcores of --config only
+ * receive, spreading their packets over the rings of the worker lcores,
+ * which look them up and forward them. With --tx-lcores the workers hand
+ * the routed packets to per-port rings instead of sending them, drained by
+ * the TX lcore owning the port. See init_pipeline().
+ */
+enum lcore_role {
+	LCORE_ROLE_RTC = 0, /**< receive and forward, run to completion */
+	LCORE_ROLE_RX,
+	LCORE_ROLE_WORKER,
+	LCORE_ROLE_TX,
+	LCORE_ROLE_CONTROL, /**< moves RX queues between lcores, see rebalance_step() */
+	LCORE_ROLE_MAX
+};
+
+static const char *lcore_role_name[LCORE_ROLE_MAX] = {
+	"run-to-completion", "rx", "worker", "tx", "control"
+};
+
+#define MAX_PIPELINE_LCORES 16
+#define PIPELINE_RING_SIZE 1024
+
+static uint8_t worker_lcores[MAX_PIPELINE_LCORES];
+static uint16_t nb_worker_lcores = 0;
+static uint8_t tx_lcores[MAX_PIPELINE_LCORES];
+static uint16_t nb_tx_lcores = 0;
+static struct rte_ring *worker_ring[MAX_PIPELINE_LCORES]; /**< input of each worker */
+static struct rte_ring *port_tx_ring[RTE_MAX_ETHPORTS]; /**< input of the TX lcore of a port */
+/* spread by a software hash of the 5-tuple rather than the RSS hash */
+static int sw_distribute = 0;
+
+/*
+ * Reorder stage, set with --reorder: RX lcores give each burst to the
+ * least loaded worker whatever its flows, so that one flow may be worked
+ * on by several workers at once, and number the packets in hash.rss. The
+ * top byte of the number is the index of the RX lcore, to which the
+ * workers return the routed packets; it sends them in their receive order,
+ * see reorder_poll().
+ */
+#define SEQ_BITS 24
+#define SEQ_MASK ((1U << SEQ_BITS) - 1)
+#define REORDER_WINDOW 1024 /**< power of 2, packets buffered per RX lcore */
+#define REORDER_RING_SIZE 4096
+#define REORDER_TIMEOUT_US 100
+
+static int reorder = 0;
+static unsigned reorder_timeout_us = REORDER_TIMEOUT_US;
+static uint64_t reorder_timeout_tsc;
+static struct rte_ring *reorder_ring[MAX_PIPELINE_LCORES]; /**< input of each RX lcore */
+
+struct reorder_buffer {
+	uint32_t next_seq; /**< next sequence number to send */
+	uint32_t count;    /**< packets buffered */
+	uint64_t gap_tsc;  /**< since when next_seq is waited for, 0 if it is not */
+	uint64_t late;     /**< packets sent out of order, after their number was skipped */
+	uint64_t skipped;  /**< numbers given up on */
+	uint64_t dropped;  /**< packets the workers dropped and gave back */
+	uint64_t window_full; /**< dropped with REORDER_WINDOW numbers in flight */
+	struct rte_mbuf *slot[REORDER_WINDOW];
+};
+
+/* where a lcore sends its routed packets */
+#define TX_TO_NIC 0
+#define TX_TO_PORT_RING 1 /**< the ring of the port's TX lcore */
+#define TX_TO_REORDER 2   /**< the ring of the packet's RX lcore */
+
+/*
+ * RX queue rebalancing, set with --rebalance-lcore: every polling lcore
+ * accounts its loop cycles as busy or idle, and the control lcore moves
+ * an RX queue from the busiest lcore to the least busy one when their
+ * loads drift apart. Loads are in per mille of the last interval.
+ */
+#define REBALANCE_INTERVAL_MS 100
+#define REBALANCE_LOAD_HIGH 800 /**< do not move below this load */
+#define REBALANCE_LOAD_GAP 200  /**< nor for a smaller load difference */
+
+static int rebalance_lcore = -1; /**< control lcore, -1 when not rebalancing */
+static unsigned rebalance_ms = REBALANCE_INTERVAL_MS;
+static uint16_t lcore_load[RTE_MAX_LCORE]; /**< load over the last interval */
+static uint64_t rebalance_moves = 0;
+
+/*
+ * RSS redirection table rebalancing, set with --reta-rebalance: polling
+ * lcores count the packets of each RETA bucket of their ports, and the
+ * control lcore moves the bucket that best evens out the busiest and the
+ * least busy RX queue of a port between them, see reta_rebalance_step().
+ */
+#define RETA_LOAD_GAP 20        /**< percent of the busiest queue's packets */
+#define RETA_MIN_PKTS 1000      /**< per interval on the busiest queue */
+#define RETA_DRAIN_TIMEOUT_US 1000
+
+static int reta_rebalance = 0;
+static uint8_t port_reta[RTE_MAX_ETHPORTS][ETH_RSS_RETA_NUM_ENTRIES];
+static uint8_t port_reta_queues[RTE_MAX_ETHPORTS]; /**< queues in port_reta[], 0 if unknown */
+static uint64_t reta_moves = 0;
+static uint64_t reta_drain_timeouts = 0;
+
+/*
+ * Idle backoff, set with --idle-backoff: after IDLE_SPIN_ROUNDS poll rounds
+ * without a packet, a polling lcore pauses between rounds, 1 us at first
+ * and twice as long after each empty round up to idle_max_us, until a
+ * round brings packets. Pauses shorter than IDLE_SLEEP_US spin on the
+ * pause instruction, longer ones give the CPU away. An lcore does not
+ * pause while a RETA update waits for it to drain a queue. With --cpufreq, an
+ * lcore whose pause reached idle_max_us also drops its core to the lowest
+ * frequency through the cpufreq sysfs, see librte_power, and raises it
+ * back on its first packets.
+ */
+#define IDLE_SPIN_ROUNDS 300
+#define IDLE_SLEEP_US 100
+#define IDLE_MAX_US 1000
+
+static int idle_backoff = 0;
+static unsigned idle_max_us = IDLE_MAX_US;
+static int cpufreq = 0;
+
 #if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)	
 static int ipv6 = 1; /**< ipv6 is false by default. */
 #endif
@@ -186,12 +423,25 @@ struct mbuf_table {
 struct lcore_rx_queue {
 	uint8_t port_id;
 	uint8_t queue_id;
+	uint64_t rx_pkts; /**< received on the queue, follows it across lcores */
+	volatile uint8_t hold;      /**< not polled during a RETA update */
+	volatile uint8_t drain_req; /**< cleared once polled empty, ditto */
 } __rte_cache_aligned;
 
 #define MAX_RX_QUEUE_PER_LCORE 16
 #define MAX_TX_QUEUE_PER_PORT RTE_MAX_ETHPORTS
 #define MAX_RX_QUEUE_PER_PORT 128
 
+/*
+ * Ports get TX queues for the lcores that send only, up to what the NIC
+ * has or --tx-queues allows. The lcores left without a queue on a port
+ * send through a multi-producer ring drained by the first lcore that has
+ * one, see share_tx_queues().
+ */
+#define TX_QUEUE_SHARED ((uint16_t)-1) /**< tx_queue_id[] of those lcores */
+static unsigned max_tx_queues = MAX_TX_QUEUE_PER_PORT;
+static uint8_t tx_queue_owner[RTE_MAX_ETHPORTS]; /**< lcore of the first queue */
+
 #define MAX_LCORE_PARAMS 1024
 struct lcore_params {
 	uint8_t port_id;
@@ -213,6 +463,7 @@ static struct lcore_params lcore_params_array_default[] = {
 };
 
 static struct lcore_params * lcore_params = lcore_params_array_default;
+static int auto_config = 0; /**< lcore_params built by auto_configure() */
 static uint16_t nb_lcore_params = sizeof(lcore_params_array_default) /
 				sizeof(lcore_params_array_default[0]);
 
@@ -238,13 +489,13 @@ static struct rte_eth_conf port_conf = {
 	},
 };
 
-static const struct rte_eth_rxconf rx_conf = {
+static struct rte_eth_rxconf rx_conf = {
 	.rx_thresh = {
 		.pthresh = RX_PTHRESH,
 		.hthresh = RX_HTHRESH,
 		.wthresh = RX_WTHRESH,
 	},
-	.rx_free_thresh = 32,
+	.rx_free_thresh = RX_FREE_THRESH,
 };
 
 static struct rte_eth_txconf tx_conf = {
@@ -263,10 +514,28 @@ static struct rte_eth_txconf tx_conf = {
 
 };
 
-static struct rte_mempool * pktmbuf_pool[NB_SOCKETS];
+/*
+ * Received frames may be segment chains, which the simple TX path of the
+ * queues above does not take: every lcore then gets a second, full
+ * featured TX queue per port for them, see send_mseg_pkts().
+ */
+static int tx_mseg = 0;
 
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+/*
+ * mbuf pools, one per socket that RX queues fill, or with --per-port-pool
+ * one per port and socket, see init_mem(). The pools of the sockets are
+ * at index SOCKET_POOL.
+ */
+#define SOCKET_POOL RTE_MAX_ETHPORTS
 
+static int per_port_pool = 0;
+static struct rte_mempool *pktmbuf_pool[RTE_MAX_ETHPORTS + 1][NB_SOCKETS];
+static uint16_t port_n_tx_queue[RTE_MAX_ETHPORTS]; /**< TX queues set up */
+
+/*
+ * 5-tuple keys, the exact match tables use them as they are and the
+ * software distributor of the pipeline hashes them, see flow_hash().
+ */
 #ifdef RTE_MACHINE_CPUFLAG_SSE4_2
 #include <rte_hash_crc.h>
 #define DEFAULT_HASH_FUNC       rte_hash_crc
@@ -320,6 +589,81 @@ union ipv6_5tuple_host {
 	__m128i xmm[XMM_NUM_IN_IPV6_5TUPLE];
 };
 
+#define ALL_32_BITS 0xffffffff
+#define BIT_8_TO_15 0x0000ff00
+#define BIT_16_TO_23 0x00ff0000
+
+static inline uint32_t
+ipv4_hash_crc(const void *data, __rte_unused uint32_t data_len,
+	uint32_t init_val)
+{
+	const union ipv4_5tuple_host *k;
+	uint32_t t;
+	const uint32_t *p;
+
+	k = data;
+	t = k->proto;
+	p = (const uint32_t *)&k->port_src;
+
+#ifdef RTE_MACHINE_CPUFLAG_SSE4_2
+	init_val = rte_hash_crc_4byte(t, init_val);
+	init_val = rte_hash_crc_4byte(k->ip_src, init_val);
+	init_val = rte_hash_crc_4byte(k->ip_dst, init_val);
+	init_val = rte_hash_crc_4byte(*p, init_val);
+#else /* RTE_MACHINE_CPUFLAG_SSE4_2 */
+	init_val = rte_jhash_1word(t, init_val);
+	init_val = rte_jhash_1word(k->ip_src, init_val);
+	init_val = rte_jhash_1word(k->ip_dst, init_val);
+	init_val = rte_jhash_1word(*p, init_val);
+#endif /* RTE_MACHINE_CPUFLAG_SSE4_2 */
+	return (init_val);
+}
+
+static inline uint32_t
+ipv6_hash_crc(const void *data, __rte_unused uint32_t data_len, uint32_t init_val)
+{
+	const union ipv6_5tuple_host *k;
+	uint32_t t;
+	const uint32_t *p;
+#ifdef RTE_MACHINE_CPUFLAG_SSE4_2
+	const uint32_t  *ip_src0, *ip_src1, *ip_src2, *ip_src3;
+	const uint32_t  *ip_dst0, *ip_dst1, *ip_dst2, *ip_dst3;
+#endif /* RTE_MACHINE_CPUFLAG_SSE4_2 */
+ 
+	k = data;
+	t = k->proto;
+	p = (const uint32_t *)&k->port_src;
+ 
+#ifdef RTE_MACHINE_CPUFLAG_SSE4_2
+	ip_src0 = (const uint32_t *) k->ip_src;
+	ip_src1 = (const uint32_t *)(k->ip_src+4);
+	ip_src2 = (const uint32_t *)(k->ip_src+8);
+	ip_src3 = (const uint32_t *)(k->ip_src+12);
+	ip_dst0 = (const uint32_t *) k->ip_dst;
+	ip_dst1 = (const uint32_t *)(k->ip_dst+4);
+	ip_dst2 = (const uint32_t *)(k->ip_dst+8);
+	ip_dst3 = (const uint32_t *)(k->ip_dst+12);
+	init_val = rte_hash_crc_4byte(t, init_val);
+	init_val = rte_hash_crc_4byte(*ip_src0, init_val);
+	init_val = rte_hash_crc_4byte(*ip_src1, init_val);
+	init_val = rte_hash_crc_4byte(*ip_src2, init_val);
+	init_val = rte_hash_crc_4byte(*ip_src3, init_val);
+	init_val = rte_hash_crc_4byte(*ip_dst0, init_val);
+	init_val = rte_hash_crc_4byte(*ip_dst1, init_val);
+	init_val = rte_hash_crc_4byte(*ip_dst2, init_val);
+	init_val = rte_hash_crc_4byte(*ip_dst3, init_val);
+	init_val = rte_hash_crc_4byte(*p, init_val);
+#else /* RTE_MACHINE_CPUFLAG_SSE4_2 */
+	init_val = rte_jhash_1word(t, init_val);
+	init_val = rte_jhash(k->ip_src, sizeof(uint8_t) * IPV6_ADDR_LEN, init_val);
+	init_val = rte_jhash(k->ip_dst, sizeof(uint8_t) * IPV6_ADDR_LEN, init_val);
+	init_val = rte_jhash_1word(*p, init_val);
+#endif /* RTE_MACHINE_CPUFLAG_SSE4_2 */
+	return (init_val);
+}
+
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+
 /* Type of NAT. */
 #define SNAT 0
 #define DNAT 1
@@ -439,74 +783,69 @@ static lookup_struct_t *ipv6_l3fwd_lookup_struct[NB_SOCKETS];
  
 static uint32_t hash_entry_number = HASH_ENTRY_NUMBER_DEFAULT;
 
-static inline uint32_t
-ipv4_hash_crc(const void *data, __rte_unused uint32_t data_len,
-	uint32_t init_val)
-{
-	const union ipv4_5tuple_host *k;
-	uint32_t t;
-	const uint32_t *p;
+/*
+ * Exact match table statistics. Every lookup is counted per lcore; one
+ * lookup out of (EM_STATS_SAMPLE_MASK + 1) has its bucket probe replayed
+ * to measure how many signatures and keys it had to compare. rte_hash
+ * keeps a key in a single bucket, so a lookup always touches one bucket.
+ */
+#define ENABLE_EM_STATS		1
+#define EM_STATS_SAMPLE_MASK	0x3ff
+
+enum em_lookup_type {
+	EM_LOOKUP_IPV4 = 0,
+	EM_LOOKUP_IPV6,
+	EM_LOOKUP_IPV6_NAT,
+	EM_LOOKUP_TYPE_MAX
+};
 
-	k = data;
-	t = k->proto;
-	p = (const uint32_t *)&k->port_src;
+static const char *em_lookup_type_name[EM_LOOKUP_TYPE_MAX] = {
+	"ipv4", "ipv6", "ipv6-nat"
+};
 
-#ifdef RTE_MACHINE_CPUFLAG_SSE4_2
-	init_val = rte_hash_crc_4byte(t, init_val);
-	init_val = rte_hash_crc_4byte(k->ip_src, init_val);
-	init_val = rte_hash_crc_4byte(k->ip_dst, init_val);
-	init_val = rte_hash_crc_4byte(*p, init_val);
-#else /* RTE_MACHINE_CPUFLAG_SSE4_2 */
-	init_val = rte_jhash_1word(t, init_val);
-	init_val = rte_jhash_1word(k->ip_src, init_val);
-	init_val = rte_jhash_1word(k->ip_dst, init_val);
-	init_val = rte_jhash_1word(*p, init_val);
-#endif /* RTE_MACHINE_CPUFLAG_SSE4_2 */
-	return (init_val);
-}
+struct em_lookup_stats {
+	uint64_t cache_hits;  /**< answered by the lcore flow cache */
+	uint64_t lookups;     /**< answered by the table */
+	uint64_t misses;
+	uint64_t sampled;     /**< lookups whose bucket probe was replayed */
+	uint64_t sig_cmps;    /**< signatures compared by sampled lookups */
+	uint64_t key_cmps;    /**< keys compared by sampled lookups */
+	uint32_t max_sig_cmps;
+};
 
-static inline uint32_t
-ipv6_hash_crc(const void *data, __rte_unused uint32_t data_len, uint32_t init_val)
-{
-	const union ipv6_5tuple_host *k;
-	uint32_t t;
-	const uint32_t *p;
-#ifdef RTE_MACHINE_CPUFLAG_SSE4_2
-	const uint32_t  *ip_src0, *ip_src1, *ip_src2, *ip_src3;
-	const uint32_t  *ip_dst0, *ip_dst1, *ip_dst2, *ip_dst3;
-#endif /* RTE_MACHINE_CPUFLAG_SSE4_2 */
- 
-	k = data;
-	t = k->proto;
-	p = (const uint32_t *)&k->port_src;
- 
-#ifdef RTE_MACHINE_CPUFLAG_SSE4_2
-	ip_src0 = (const uint32_t *) k->ip_src;
-	ip_src1 = (const uint32_t *)(k->ip_src+4);
-	ip_src2 = (const uint32_t *)(k->ip_src+8);
-	ip_src3 = (const uint32_t *)(k->ip_src+12);
-	ip_dst0 = (const uint32_t *) k->ip_dst;
-	ip_dst1 = (const uint32_t *)(k->ip_dst+4);
-	ip_dst2 = (const uint32_t *)(k->ip_dst+8);
-	ip_dst3 = (const uint32_t *)(k->ip_dst+12);
-	init_val = rte_hash_crc_4byte(t, init_val);
-	init_val = rte_hash_crc_4byte(*ip_src0, init_val);
-	init_val = rte_hash_crc_4byte(*ip_src1, init_val);
-	init_val = rte_hash_crc_4byte(*ip_src2, init_val);
-	init_val = rte_hash_crc_4byte(*ip_src3, init_val);
-	init_val = rte_hash_crc_4byte(*ip_dst0, init_val);
-	init_val = rte_hash_crc_4byte(*ip_dst1, init_val);
-	init_val = rte_hash_crc_4byte(*ip_dst2, init_val);
-	init_val = rte_hash_crc_4byte(*ip_dst3, init_val);
-	init_val = rte_hash_crc_4byte(*p, init_val);
-#else /* RTE_MACHINE_CPUFLAG_SSE4_2 */
-	init_val = rte_jhash_1word(t, init_val);
-	init_val = rte_jhash(k->ip_src, sizeof(uint8_t) * IPV6_ADDR_LEN, init_val);
-	init_val = rte_jhash(k->ip_dst, sizeof(uint8_t) * IPV6_ADDR_LEN, init_val);
-	init_val = rte_jhash_1word(*p, init_val);
-#endif /* RTE_MACHINE_CPUFLAG_SSE4_2 */
-	return (init_val);
-}
+struct lcore_em_stats {
+	struct em_lookup_stats lookup[EM_LOOKUP_TYPE_MAX];
+} __rte_cache_aligned;
+
+static struct lcore_em_stats em_stats[RTE_MAX_LCORE];
+
+/* Occupancy of one table, computed once after it has been populated. */
+struct em_table_info {
+	uint32_t add_failures;  /**< keys dropped because their bucket was full */
+	uint32_t fill_hist[RTE_HASH_BUCKET_ENTRIES_MAX + 1];
+};
+
+static struct em_table_info ipv4_em_info[NB_SOCKETS];
+static struct em_table_info ipv6_em_info[NB_SOCKETS];
+
+/*
+ * With --table-policy cached, each lcore keeps a small direct-mapped cache
+ * of recent lookup results, in memory local to its socket, in front of the
+ * single shared table. Negative results are cached as well. Entries are
+ * never invalidated, the tables are not modified once the ports start.
+ * An entry holds only as many 16 byte key words as its family needs: 32
+ * bytes for IPv4 and 64 for IPv6, i.e. 32 KB and 64 KB per lcore.
+ */
+#define EM_CACHE_ENTRIES	1024
+
+struct em_cache_entry {
+	hash_sig_t sig;   /**< 0 marks an unused entry */
+	int32_t pos;      /**< rte_hash position, negative on a miss */
+	__m128i key[];    /**< nb_xmm words, see EM_CACHE_ENTRY_SIZE() */
+};
+
+#define EM_CACHE_ENTRY_SIZE(nb_xmm) \
+	(sizeof(struct em_cache_entry) + (nb_xmm) * sizeof(__m128i))
 
 #define IPV4_L3FWD_NUM_ROUTES \
 	(sizeof(ipv4_l3fwd_route_array) / sizeof(ipv4_l3fwd_route_array[0]))
@@ -514,6 +853,11 @@ ipv6_hash_crc(const void *data, __rte_unused uint32_t data_len, uint32_t init_va
 #define IPV6_L3FWD_NUM_ROUTES \
 	(sizeof(ipv6_l3fwd_route_array) / sizeof(ipv6_l3fwd_route_array[0]))
 
+/*
+ * Output port of each hash position. One array serves the tables of all
+ * sockets, whose builds add the same keys in the same order; only the
+ * build of table_first_socket writes it.
+ */
 static uint8_t ipv4_l3fwd_out_if[L3FWD_HASH_ENTRIES] __rte_cache_aligned;
 static uint8_t ipv6_l3fwd_out_if[L3FWD_HASH_ENTRIES] __rte_cache_aligned;
 
@@ -572,68 +916,447 @@ static lookup_struct_t *ipv4_l3fwd_lookup_struct[NB_SOCKETS];
 static lookup6_struct_t *ipv6_l3fwd_lookup_struct[NB_SOCKETS];
 #endif
 
+/* Nodes of the forwarding graph, see l3fwd_forward_burst() */
+enum fwd_node {
+	FWD_NODE_PARSE = 0,
+	FWD_NODE_VALIDATE,
+	FWD_NODE_IPV4_LOOKUP,
+	FWD_NODE_IPV6_NAT,
+	FWD_NODE_IPV6_LOOKUP,
+	FWD_NODE_REWRITE,
+	FWD_NODE_OTHER,
+	FWD_NODE_TX,
+	FWD_NODE_MAX
+};
+
+static const char * const fwd_node_name[FWD_NODE_MAX] = {
+	"parse", "validate", "ipv4-lookup", "ipv6-nat", "ipv6-lookup",
+	"rewrite", "other", "tx"
+};
+
+struct fwd_node_stats {
+	uint64_t calls;  /**< non-empty vectors processed */
+	uint64_t pkts;   /**< packets in them */
+	uint64_t cycles; /**< TSC cycles spent, only with --node-cycles */
+};
+
+static int node_cycles = 0; /**< account the cycles of every node run */
+
+/* Counters of the TX queue of an lcore on one port */
+struct tx_queue_stats {
+	uint64_t sent;    /**< packets the NIC took */
+	uint64_t full;    /**< bursts the queue could not take entirely */
+	uint64_t retries; /**< extra tx_burst calls of the retry policy */
+	uint64_t dropped; /**< packets freed unsent */
+};
+
+struct lcore_conf;
+
+/* A forwarding loop body specialized for one ISA and set of FWD_F_ flags */
+typedef void (*fwd_burst_t)(struct rte_mbuf **pkts, int nb_rx, uint8_t portid,
+	struct lcore_conf *qconf);
+
+/* portid of a burst gathered from several ports, in_port is set per packet */
+#define RX_PORT_MIXED 0xff
+
 struct lcore_conf {
 	uint16_t n_rx_queue;
+	uint16_t rx_queue_next; /**< first queue of the next coalesced poll */
+	fwd_burst_t fwd_burst;
+	uint8_t role;       /**< enum lcore_role */
+	uint8_t tx_to_ring; /**< TX_TO_NIC, TX_TO_PORT_RING or TX_TO_REORDER */
+	uint8_t rx_index;   /**< RX lcore: index in reorder_ring[] */
+	uint32_t seq;       /**< RX lcore: next sequence number */
+	struct reorder_buffer *reorder;
+	struct rte_ring *rx_ring; /**< worker input ring */
+	uint16_t n_ring_port;
+	uint8_t ring_port_id[RTE_MAX_ETHPORTS]; /**< ports a TX lcore drains */
+	uint64_t ring_dropped; /**< packets dropped on a full worker ring */
+	uint64_t dispatched[MAX_PIPELINE_LCORES]; /**< packets queued per worker */
+	uint8_t rebalanced;  /**< RX queues may be moved to and from the lcore */
+	uint64_t busy_tsc;   /**< cycles of loops that received packets */
+	uint64_t idle_tsc;   /**< cycles of loops that received none */
+	/* RX queue handoff, see rx_queue_handoff() */
+	volatile uint16_t handoff_queue; /**< 1 + index of the queue to give away */
+	volatile uint8_t handoff_to;
+	volatile uint8_t inbox_full;
+	struct lcore_rx_queue inbox;
+	/* packets per RETA bucket of each port, with --reta-rebalance */
+	uint32_t *rss_bucket_pkts;
+	/* idle backoff, see lcore_idle() */
+	uint32_t empty_rounds; /**< poll rounds without packets in a row */
+	uint32_t pause_us;     /**< pause between rounds, 0 while busy */
+	uint8_t cpufreq;       /**< librte_power is set up for the lcore */
+	uint8_t freq_low;      /**< the core runs at its lowest frequency */
+	uint64_t pauses;
+	uint64_t pause_tsc;    /**< cycles spent pausing */
+	uint64_t wakeups;      /**< rounds with packets that ended a pause */
+	uint64_t wake_us;      /**< sum of the pauses the wakeups ended */
+	uint32_t wake_max_us;
+	uint64_t freq_changes;
+	uint16_t n_tx_port;
+	uint8_t tx_port_id[RTE_MAX_ETHPORTS]; /**< ports this lcore sends on */
 	struct lcore_rx_queue rx_queue_list[MAX_RX_QUEUE_PER_LCORE];
 	uint16_t tx_queue_id[RTE_MAX_ETHPORTS];
+	uint16_t tx_mseg_queue_id[RTE_MAX_ETHPORTS]; /**< only with tx_mseg */
 	struct mbuf_table tx_mbufs[RTE_MAX_ETHPORTS];
 	lookup_struct_t * ipv4_lookup_struct;
 #if (APP_LOOKUP_METHOD == APP_LOOKUP_LPM)
 	lookup6_struct_t * ipv6_lookup_struct;
 #else
 	lookup_struct_t * ipv6_lookup_struct;
+	/* lcore private flow caches, only with --table-policy cached */
+	struct em_cache_entry *ipv4_cache;
+	struct em_cache_entry *ipv6_cache;
 #endif
+	struct fwd_node_stats node_stats[FWD_NODE_MAX];
+	uint64_t non_ip_dropped; /**< packets neither IPv4 nor IPv6 */
+	struct tx_queue_stats tx_stats[RTE_MAX_ETHPORTS];
 } __rte_cache_aligned;
 
 static struct lcore_conf lcore_conf[RTE_MAX_LCORE];
 
-/* Send burst of packets on an output interface */
-static inline int
-send_burst(struct lcore_conf *qconf, uint16_t n, uint8_t port)
-{
-	struct rte_mbuf **m_table;
-	int ret;
-	uint16_t queueid;
-
-	queueid = qconf->tx_queue_id[port];
-	m_table = (struct rte_mbuf **)qconf->tx_mbufs[port].m_table;
+/* Output port of a packet that has already been dropped */
+#define BAD_PORT ((uint16_t)-1)
 
-	ret = rte_eth_tx_burst(port, queueid, m_table, n);
-	if (unlikely(ret < n)) {
-		do {
-			rte_pktmbuf_free(m_table[ret]);
-		} while (++ret < n);
-	}
+/* in_port of a numbered packet a worker dropped, see free_dropped_pkts() */
+#define DROPPED_PORT ((uint8_t)-1)
 
-	return 0;
-}
+/*
+ * Arrays of output ports are padded so that the run detection in
+ * send_packets_multi() may load 8 entries past the last packet.
+ */
+#define DST_PORT_PAD 8
 
-/* Enqueue a single packet, and send burst if queue is filled */
-static inline int
-send_single_packet(struct rte_mbuf *m, uint8_t port)
+/*
+ * Free packets in bulk: single segment mbufs are returned to their pool
+ * with one put per run of packets from the same pool.
+ */
+static inline void
+free_pkts_bulk(struct rte_mbuf **pkts, uint16_t n)
 {
-	uint32_t lcore_id;
-	uint16_t len;
-	struct lcore_conf *qconf;
+	void *objs[MAX_PKT_BURST];
+	struct rte_mempool *pool = NULL;
+	struct rte_mbuf *m;
+	uint16_t i, k = 0;
+
+	for (i = 0; i < n; i++) {
+		if (unlikely(pkts[i]->pkt.nb_segs != 1)) {
+			rte_pktmbuf_free(pkts[i]);
+			continue;
+		}
+		m = __rte_pktmbuf_prefree_seg(pkts[i]);
+		if (m == NULL)
+			continue;
+		if (m->pool != pool || k == MAX_PKT_BURST) {
+			if (k != 0)
+				rte_mempool_put_bulk(pool, objs, k);
+			pool = m->pool;
+			k = 0;
+		}
+		objs[k++] = m;
+	}
+	if (k != 0)
+		rte_mempool_put_bulk(pool, objs, k);
+}
 
-	lcore_id = rte_lcore_id();
+/*
+ * Return routed packets to the RX lcores that numbered them, the output
+ * port in in_port. Stops at the first ring that is full, so that what is
+ * not taken is the end of pkts.
+ */
+static inline uint16_t
+reorder_return(uint8_t port, struct rte_mbuf **pkts, uint16_t n)
+{
+	uint32_t rx;
+	uint16_t i, first, sent;
+
+	for (i = 0; i < n; i++)
+		pkts[i]->pkt.in_port = port;
+
+	for (first = 0; first < n; first += sent) {
+		rx = pkts[first]->pkt.hash.rss >> SEQ_BITS;
+		for (i = first + 1; i < n &&
+				pkts[i]->pkt.hash.rss >> SEQ_BITS == rx; i++)
+			;
+		sent = (uint16_t)rte_ring_mp_enqueue_burst(reorder_ring[rx],
+			(void **)&pkts[first], i - first);
+		if (sent < i - first)
+			return first + sent;
+	}
+	return n;
+}
 
-	qconf = &lcore_conf[lcore_id];
-	len = qconf->tx_mbufs[port].len;
-	qconf->tx_mbufs[port].m_table[len] = m;
-	len++;
+/*
+ * Return all of pkts to the RX lcores, waiting for room in their rings:
+ * a number that never comes back stalls the reorder stage until the
+ * timeout. An RX lcore never waits for its workers, so it always drains
+ * its ring.
+ */
+static inline void
+reorder_return_all(uint8_t port, struct rte_mbuf **pkts, uint16_t n)
+{
+	uint16_t sent;
 
-	/* enough pkts to be sent */
-	if (unlikely(len == MAX_PKT_BURST)) {
-		send_burst(qconf, MAX_PKT_BURST, port);
-		len = 0;
+	while ((sent = reorder_return(port, pkts, n)) < n) {
+		pkts += sent;
+		n = (uint16_t)(n - sent);
+		_mm_pause();
+	}
+}
+
+/*
+ * Free packets the lcore drops. A pipeline worker with --reorder gives
+ * them back to the RX lcores instead, in_port DROPPED_PORT, so that their
+ * numbers are released at once rather than waited for.
+ */
+static inline void
+free_dropped_pkts(struct lcore_conf *qconf, struct rte_mbuf **pkts,
+	uint16_t n)
+{
+	if (likely(qconf->tx_to_ring != TX_TO_REORDER))
+		free_pkts_bulk(pkts, n);
+	else if (n != 0)
+		reorder_return_all(DROPPED_PORT, pkts, n);
+}
+
+/*
+ * Hand packets to the TX queue of the lcore on a port, or for a pipeline
+ * worker to the ring of the port's TX lcore or of the RX lcore, which
+ * takes them all.
+ */
+static inline uint16_t
+tx_burst(struct lcore_conf *qconf, uint8_t port, struct rte_mbuf **pkts,
+	uint16_t n)
+{
+	if (likely(qconf->tx_to_ring == TX_TO_NIC) &&
+			likely(qconf->tx_queue_id[port] != TX_QUEUE_SHARED))
+		return rte_eth_tx_burst(port, qconf->tx_queue_id[port], pkts, n);
+	if (qconf->tx_to_ring != TX_TO_REORDER)
+		return (uint16_t)rte_ring_mp_enqueue_burst(port_tx_ring[port],
+			(void **)pkts, n);
+	reorder_return_all(port, pkts, n);
+	return n;
+}
+
+/*
+ * Send packets on an output interface. What the NIC does not take is
+ * handled according to tx_policy. Returns the number of packets left
+ * unsent at the end of m_table, which only the hold policy leaves for the
+ * caller to keep; the others free them.
+ */
+static inline uint16_t
+send_pkts(struct lcore_conf *qconf, uint8_t port, struct rte_mbuf **m_table,
+	uint16_t n)
+{
+	struct tx_queue_stats *st = &qconf->tx_stats[port];
+	uint64_t deadline;
+	uint16_t ret;
+
+	ret = tx_burst(qconf, port, m_table, n);
+	if (unlikely(ret < n)) {
+		st->full++;
+		if (tx_policy == TX_POLICY_RETRY) {
+			deadline = rte_rdtsc() + tx_retry_tsc;
+			do {
+				st->retries++;
+				ret += tx_burst(qconf, port, m_table + ret, n - ret);
+			} while (ret < n && rte_rdtsc() < deadline);
+		}
+		if (ret < n && tx_policy == TX_POLICY_HOLD) {
+			st->sent += ret;
+			return n - ret;
+		}
+		if (ret < n) {
+			free_pkts_bulk(m_table + ret, n - ret);
+			st->dropped += n - ret;
+		}
 	}
 
-	qconf->tx_mbufs[port].len = len;
+	st->sent += ret;
 	return 0;
 }
 
-#ifdef DO_RFC_1812_CHECKS
+/*
+ * Send burst of packets on an output interface, what the hold policy
+ * keeps moves to the front of the TX buffer.
+ */
+static inline void
+send_burst(struct lcore_conf *qconf, uint16_t n, uint8_t port)
+{
+	struct mbuf_table *txb = &qconf->tx_mbufs[port];
+	uint16_t left;
+
+	left = send_pkts(qconf, port, txb->m_table, n);
+	if (unlikely(left != 0))
+		memmove(txb->m_table, &txb->m_table[n - left],
+			left * sizeof(txb->m_table[0]));
+	txb->len = left;
+}
+
+/* Append packets going to one port to its TX buffer, sending full bursts */
+static inline void
+send_packets_to_port(struct lcore_conf *qconf, uint8_t port,
+	struct rte_mbuf **pkts, uint16_t n)
+{
+	struct mbuf_table *txb = &qconf->tx_mbufs[port];
+	uint16_t room;
+
+	room = MAX_PKT_BURST - txb->len;
+	while (unlikely(n >= room)) {
+		rte_memcpy(&txb->m_table[txb->len], pkts, room * sizeof(pkts[0]));
+		send_burst(qconf, MAX_PKT_BURST, port);
+		pkts += room;
+		n -= room;
+		room = MAX_PKT_BURST - txb->len;
+		if (unlikely(room == 0)) {
+			/* held packets fill the buffer, drop the new ones */
+			free_pkts_bulk(pkts, n);
+			qconf->tx_stats[port].dropped += n;
+			return;
+		}
+	}
+
+	rte_memcpy(&txb->m_table[txb->len], pkts, n * sizeof(pkts[0]));
+	txb->len += n;
+}
+
+/*
+ * Return a mask with bit i set when packet i is the last one of a run of
+ * packets going to the same port. Eight ports are compared per step;
+ * dst_port[] must have DST_PORT_PAD readable entries past nb.
+ */
+static inline uint64_t
+port_run_ends(const uint16_t *dst_port, int nb)
+{
+	__m128i cur, next, eq;
+	uint64_t ends = 0;
+	uint32_t same;
+	int j;
+
+	for (j = 0; j < nb; j += 8) {
+		cur = _mm_loadu_si128((const __m128i *)&dst_port[j]);
+		next = _mm_loadu_si128((const __m128i *)&dst_port[j + 1]);
+		eq = _mm_cmpeq_epi16(cur, next);
+		same = _mm_movemask_epi8(_mm_packs_epi16(eq, _mm_setzero_si128()));
+		ends |= (uint64_t)(~same & 0xff) << j;
+	}
+
+	ends &= (UINT64_MAX >> (64 - nb));
+	ends |= (uint64_t)1 << (nb - 1);
+	return ends;
+}
+
+/*
+ * Send a vector of up to MAX_PKT_BURST routed packets. Each run of packets
+ * going to the same port is appended to that port's TX buffer with one
+ * copy; packets marked BAD_PORT have been dropped and are skipped. A vector
+ * that goes entirely to one port with nothing buffered for it is handed to
+ * the NIC directly, what the NIC refuses must fit the TX buffer.
+ */
+static inline void
+send_packets_multi(struct lcore_conf *qconf, struct rte_mbuf **pkts,
+	uint16_t *dst_port, int nb)
+{
+	uint64_t ends;
+	int first, last;
+
+	/* the runs are a 64-bit mask, the leftovers go to a TX buffer */
+	RTE_BUILD_BUG_ON(MAX_PKT_BURST > 64);
+
+	if (unlikely(nb == 0))
+		return;
+
+	ends = port_run_ends(dst_port, nb);
+	if (ends == (uint64_t)1 << (nb - 1) && dst_port[0] != BAD_PORT &&
+			nb <= MAX_PKT_BURST &&
+			qconf->tx_mbufs[dst_port[0]].len == 0) {
+		first = send_pkts(qconf, (uint8_t)dst_port[0], pkts, (uint16_t)nb);
+		if (unlikely(first != 0)) {
+			rte_memcpy(qconf->tx_mbufs[dst_port[0]].m_table,
+				&pkts[nb - first], first * sizeof(pkts[0]));
+			qconf->tx_mbufs[dst_port[0]].len = (uint16_t)first;
+		}
+		return;
+	}
+
+	first = 0;
+	while (ends != 0) {
+		last = __builtin_ctzll(ends);
+		ends &= ends - 1;
+		if (dst_port[first] != BAD_PORT)
+			send_packets_to_port(qconf, (uint8_t)dst_port[first],
+				&pkts[first], (uint16_t)(last + 1 - first));
+		first = last + 1;
+	}
+}
+
+/*
+ * Send the multi-segment packets of a routed vector on the full featured
+ * TX queues and mark them BAD_PORT, so that send_packets_multi() queues
+ * only single segment packets for the simple TX path. They are large, one
+ * tx_burst per packet costs little next to the time on the wire. Packets
+ * for a port whose queues the lcore shares go to the ring, the lcore
+ * draining it sends them.
+ */
+static inline void
+send_mseg_pkts(struct lcore_conf *qconf, struct rte_mbuf **pkts,
+	uint16_t *dst_port, int nb)
+{
+	uint8_t port;
+	int j;
+
+	for (j = 0; j < nb; j++) {
+		if (likely(pkts[j]->pkt.nb_segs == 1) || dst_port[j] == BAD_PORT)
+			continue;
+		port = (uint8_t)dst_port[j];
+		if (qconf->tx_queue_id[port] == TX_QUEUE_SHARED)
+			continue;
+		if (rte_eth_tx_burst(port, qconf->tx_mseg_queue_id[port],
+				&pkts[j], 1) == 0) {
+			rte_pktmbuf_free(pkts[j]);
+			qconf->tx_stats[port].full++;
+			qconf->tx_stats[port].dropped++;
+		} else
+			qconf->tx_stats[port].sent++;
+		dst_port[j] = BAD_PORT;
+	}
+}
+
+/*
+ * First 16 bytes of a frame forwarded to each port: destination MAC
+ * 02:00:00:00:00:<port> and the port's own MAC as source. The last 4 bytes,
+ * ether_type and the start of the L3 header, are kept from the packet, see
+ * rewrite_l2_hdr().
+ */
+static __m128i port_l2_hdr[RTE_MAX_ETHPORTS];
+
+static void
+init_port_l2_hdr(uint8_t portid)
+{
+	union {
+		struct ether_hdr eth;
+		uint8_t bytes[sizeof(__m128i)];
+	} hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.eth.d_addr.addr_bytes[0] = 0x02;
+	hdr.eth.d_addr.addr_bytes[5] = portid;
+	ether_addr_copy(&ports_eth_addr[portid], &hdr.eth.s_addr);
+	port_l2_hdr[portid] = _mm_loadu_si128((__m128i *)hdr.bytes);
+}
+
+static inline void
+rewrite_l2_hdr(struct ether_hdr *eth_hdr, uint16_t port)
+{
+	const __m128i keep = _mm_setr_epi32(0, 0, 0, -1);
+	__m128i hdr;
+
+	hdr = _mm_loadu_si128((__m128i *)eth_hdr);
+	hdr = _mm_or_si128(_mm_and_si128(hdr, keep), port_l2_hdr[port]);
+	_mm_storeu_si128((__m128i *)eth_hdr, hdr);
+}
+
 static inline int
 is_valid_ipv4_pkt(struct ipv4_hdr *pkt, uint32_t link_len)
 {
@@ -670,9 +1393,144 @@ is_valid_ipv4_pkt(struct ipv4_hdr *pkt, uint32_t link_len)
 	if (rte_cpu_to_be_16(pkt->total_length) < sizeof(struct ipv4_hdr))
 		return -5;
 
+	/*
+	 * 6. A packet whose TTL would reach zero here must not be forwarded
+	 * (section 5.3.1).
+	 */
+	if (pkt->time_to_live <= 1)
+		return -6;
+
 	return 0;
 }
-#endif
+
+/* The same checks for IPv6: version 6 and a hop limit that does not expire */
+static inline int
+is_valid_ipv6_pkt(struct ipv6_hdr *pkt, uint32_t link_len)
+{
+	if (link_len < sizeof(struct ipv6_hdr))
+		return -1;
+
+	if ((rte_be_to_cpu_32(pkt->vtc_flow) >> 28) != 6)
+		return -3;
+
+	if (pkt->hop_limits <= 1)
+		return -6;
+
+	return 0;
+}
+
+/*
+ * is_valid_ipv4_pkt() for four packets at once, returns a mask with bit i
+ * set when m[i] may be forwarded.
+ */
+static inline uint32_t
+ipv4_valid_mask_x4(struct rte_mbuf *m[4])
+{
+	const uint8_t *h[4];
+	__m128i w0, ttl, tl, len, v, ok;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		h[i] = rte_pktmbuf_mtod(m[i], uint8_t *) + sizeof(struct ether_hdr);
+
+	/* version_ihl, type_of_service and total_length */
+	w0 = _mm_setr_epi32(*(const int32_t *)h[0], *(const int32_t *)h[1],
+		*(const int32_t *)h[2], *(const int32_t *)h[3]);
+	ttl = _mm_setr_epi32(h[0][offsetof(struct ipv4_hdr, time_to_live)],
+		h[1][offsetof(struct ipv4_hdr, time_to_live)],
+		h[2][offsetof(struct ipv4_hdr, time_to_live)],
+		h[3][offsetof(struct ipv4_hdr, time_to_live)]);
+	len = _mm_setr_epi32(m[0]->pkt.pkt_len, m[1]->pkt.pkt_len,
+		m[2]->pkt.pkt_len, m[3]->pkt.pkt_len);
+
+	/* version 4 and a header length of at least 5 words: 0x45 to 0x4f */
+	v = _mm_and_si128(w0, _mm_set1_epi32(0xff));
+	ok = _mm_and_si128(_mm_cmpgt_epi32(v, _mm_set1_epi32(0x44)),
+		_mm_cmplt_epi32(v, _mm_set1_epi32(0x50)));
+	/* total_length is big endian in bytes 2 and 3 */
+	tl = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(w0, 8),
+		_mm_set1_epi32(0xff00)), _mm_srli_epi32(w0, 24));
+	ok = _mm_and_si128(ok, _mm_cmpgt_epi32(tl,
+		_mm_set1_epi32(sizeof(struct ipv4_hdr) - 1)));
+	ok = _mm_and_si128(ok, _mm_cmpgt_epi32(len,
+		_mm_set1_epi32(sizeof(struct ipv4_hdr) - 1)));
+	ok = _mm_and_si128(ok, _mm_cmpgt_epi32(ttl, _mm_set1_epi32(1)));
+
+	return _mm_movemask_ps(_mm_castsi128_ps(ok));
+}
+
+/* is_valid_ipv6_pkt() for four packets at once, see ipv4_valid_mask_x4() */
+static inline uint32_t
+ipv6_valid_mask_x4(struct rte_mbuf *m[4])
+{
+	const struct ipv6_hdr *h[4];
+	__m128i ver, hop, len, ok;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		h[i] = (const struct ipv6_hdr *)(rte_pktmbuf_mtod(m[i], uint8_t *) +
+			sizeof(struct ether_hdr));
+
+	ver = _mm_setr_epi32(*(const uint8_t *)h[0], *(const uint8_t *)h[1],
+		*(const uint8_t *)h[2], *(const uint8_t *)h[3]);
+	hop = _mm_setr_epi32(h[0]->hop_limits, h[1]->hop_limits,
+		h[2]->hop_limits, h[3]->hop_limits);
+	len = _mm_setr_epi32(m[0]->pkt.pkt_len, m[1]->pkt.pkt_len,
+		m[2]->pkt.pkt_len, m[3]->pkt.pkt_len);
+
+	ok = _mm_cmpeq_epi32(_mm_and_si128(ver, _mm_set1_epi32(0xf0)),
+		_mm_set1_epi32(0x60));
+	ok = _mm_and_si128(ok, _mm_cmpgt_epi32(hop, _mm_set1_epi32(1)));
+	ok = _mm_and_si128(ok, _mm_cmpgt_epi32(len,
+		_mm_set1_epi32(sizeof(struct ipv6_hdr) - 1)));
+
+	return _mm_movemask_ps(_mm_castsi128_ps(ok));
+}
+
+/*
+ * Free the packets of a vector of one IP version that fail the RFC 1812
+ * checks and compact the others to the front, so that the lookup kernels
+ * only see full groups of valid packets. Returns the number kept.
+ */
+static inline int
+drop_invalid_pkts(struct lcore_conf *qconf, struct rte_mbuf **pkts, int nb,
+	const int ipv6)
+{
+	struct rte_mbuf *dropped[MAX_PKT_BURST];
+	uint32_t valid;
+	int i, j, n = 0, nb_dropped = 0;
+
+	for (i = 0; i + 4 <= nb; i += 4) {
+		valid = ipv6 ? ipv6_valid_mask_x4(&pkts[i]) :
+			ipv4_valid_mask_x4(&pkts[i]);
+		if (likely(valid == 0xf) && n == i) {
+			n += 4;
+			continue;
+		}
+		for (j = 0; j < 4; j++) {
+			if (valid & (1 << j))
+				pkts[n++] = pkts[i + j];
+			else
+				dropped[nb_dropped++] = pkts[i + j];
+		}
+	}
+
+	for (; i < nb; i++) {
+		struct ipv4_hdr *hdr = (struct ipv4_hdr *)(rte_pktmbuf_mtod(pkts[i],
+			unsigned char *) + sizeof(struct ether_hdr));
+
+		if ((ipv6 ? is_valid_ipv6_pkt((struct ipv6_hdr *)hdr,
+					pkts[i]->pkt.pkt_len) :
+				is_valid_ipv4_pkt(hdr, pkts[i]->pkt.pkt_len)) == 0)
+			pkts[n++] = pkts[i];
+		else
+			dropped[nb_dropped++] = pkts[i];
+	}
+	if (unlikely(nb_dropped != 0))
+		free_dropped_pkts(qconf, dropped, (uint16_t)nb_dropped);
+
+	return n;
+}
 
 #if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
 
@@ -682,6 +1540,212 @@ static __m128i mask2;
 static __m128i mask3;
 static __m128i mask4;
 
+/*
+ * Replay the bucket probe rte_hash_lookup() did for a key, counting the
+ * signatures and keys it compared before it hit or gave up.
+ */
+static void
+em_stats_probe(const struct rte_hash *h, const void *key,
+	struct em_lookup_stats *st)
+{
+	const hash_sig_t *sig_bucket;
+	const uint8_t *key_bucket;
+	hash_sig_t sig;
+	uint32_t bucket, i, sig_cmps = 0, key_cmps = 0;
+
+	sig = rte_hash_hash(h, key) | h->sig_msb;
+	bucket = sig & h->bucket_bitmask;
+	sig_bucket = (const hash_sig_t *)((const uint8_t *)h->sig_tbl +
+			bucket * h->sig_tbl_bucket_size);
+	key_bucket = h->key_tbl + bucket * h->bucket_entries * h->key_tbl_key_size;
+
+	for (i = 0; i < h->bucket_entries; i++) {
+		sig_cmps++;
+		if (sig_bucket[i] != sig)
+			continue;
+		key_cmps++;
+		if (memcmp(key, key_bucket + i * h->key_tbl_key_size, h->key_len) == 0)
+			break;
+	}
+
+	st->sampled++;
+	st->sig_cmps += sig_cmps;
+	st->key_cmps += key_cmps;
+	if (sig_cmps > st->max_sig_cmps)
+		st->max_sig_cmps = sig_cmps;
+}
+
+/* Account one lookup of the given type made by the running lcore */
+static inline void
+em_stats_account(enum em_lookup_type type, const struct rte_hash *h,
+	const void *key, int32_t ret)
+{
+#if (ENABLE_EM_STATS == 1)
+	struct em_lookup_stats *st = &em_stats[rte_lcore_id()].lookup[type];
+
+	st->lookups++;
+	if (ret < 0)
+		st->misses++;
+	if (unlikely((st->lookups & EM_STATS_SAMPLE_MASK) == 0))
+		em_stats_probe(h, key, st);
+#else
+	RTE_SET_USED(type);
+	RTE_SET_USED(h);
+	RTE_SET_USED(key);
+	RTE_SET_USED(ret);
+#endif
+}
+
+static inline void
+em_stats_cache_hit(enum em_lookup_type type)
+{
+#if (ENABLE_EM_STATS == 1)
+	em_stats[rte_lcore_id()].lookup[type].cache_hits++;
+#else
+	RTE_SET_USED(type);
+#endif
+}
+
+/*
+ * Look a key of nb_xmm 16 byte words up, going through the lcore flow cache
+ * first when there is one.
+ */
+static inline int32_t
+em_lookup(const struct rte_hash *h, struct em_cache_entry *cache,
+	const __m128i *key, const unsigned nb_xmm, enum em_lookup_type type)
+{
+	struct em_cache_entry *e;
+	hash_sig_t sig;
+	int32_t ret;
+	unsigned i;
+	int hit;
+
+	if (cache == NULL) {
+		ret = rte_hash_lookup(h, key);
+		em_stats_account(type, h, key, ret);
+		return ret;
+	}
+
+	sig = rte_hash_hash(h, key) | h->sig_msb;
+	e = (struct em_cache_entry *)((uint8_t *)cache +
+		((sig ^ (sig >> 16)) & (EM_CACHE_ENTRIES - 1)) *
+		EM_CACHE_ENTRY_SIZE(nb_xmm));
+	if (e->sig == sig) {
+		hit = 1;
+		for (i = 0; i < nb_xmm; i++)
+			hit &= (_mm_movemask_epi8(_mm_cmpeq_epi8(e->key[i],
+					key[i])) == 0xffff);
+		if (hit) {
+			em_stats_cache_hit(type);
+			return e->pos;
+		}
+	}
+
+	ret = rte_hash_lookup_with_hash(h, key, sig);
+	em_stats_account(type, h, key, ret);
+	for (i = 0; i < nb_xmm; i++)
+		e->key[i] = key[i];
+	e->sig = sig;
+	e->pos = ret;
+	return ret;
+}
+
+static inline void
+em_lookup_multi(const struct rte_hash *h, struct em_cache_entry *cache,
+	const void **keys, uint32_t num_keys, const unsigned nb_xmm,
+	int32_t *positions, enum em_lookup_type type)
+{
+	uint32_t i;
+
+	if (cache == NULL) {
+		rte_hash_lookup_multi(h, keys, num_keys, positions);
+		for (i = 0; i < num_keys; i++)
+			em_stats_account(type, h, keys[i], positions[i]);
+		return;
+	}
+
+	for (i = 0; i < num_keys; i++)
+		positions[i] = em_lookup(h, cache, keys[i], nb_xmm, type);
+}
+
+/* Count how many buckets of a table hold 0, 1, ... bucket_entries keys */
+static void
+em_table_fill_histogram(const struct rte_hash *h, struct em_table_info *info)
+{
+	const hash_sig_t *sig_bucket;
+	uint32_t bucket, i, used;
+
+	memset(info->fill_hist, 0, sizeof(info->fill_hist));
+	for (bucket = 0; bucket < h->num_buckets; bucket++) {
+		sig_bucket = (const hash_sig_t *)((const uint8_t *)h->sig_tbl +
+				bucket * h->sig_tbl_bucket_size);
+		used = 0;
+		for (i = 0; i < h->bucket_entries; i++)
+			if (sig_bucket[i] != 0)
+				used++;
+		info->fill_hist[used]++;
+	}
+}
+
+static void
+print_em_table_info(const struct rte_hash *h, const struct em_table_info *info)
+{
+	uint64_t keys = 0;
+	uint32_t i;
+
+	for (i = 1; i <= h->bucket_entries; i++)
+		keys += (uint64_t)i * info->fill_hist[i];
+
+	printf("%s: %u buckets x %u, %"PRIu64" keys (%.1f%% full), "
+		"%u adds failed\n", h->name, h->num_buckets, h->bucket_entries,
+		keys, 100.0 * keys / ((uint64_t)h->num_buckets * h->bucket_entries),
+		info->add_failures);
+	printf("  bucket fill:");
+	for (i = 0; i <= h->bucket_entries; i++)
+		printf(" %u:%u", i, info->fill_hist[i]);
+	printf("\n");
+}
+
+static void
+print_em_stats(void)
+{
+	const struct em_lookup_stats *st;
+	unsigned lcore_id;
+	int socketid, type;
+
+	printf("\n====== Exact match table statistics ======\n");
+	for (socketid = 0; socketid < NB_SOCKETS; socketid++) {
+		if (ipv4_l3fwd_lookup_struct[socketid] != NULL)
+			print_em_table_info(ipv4_l3fwd_lookup_struct[socketid],
+				&ipv4_em_info[socketid]);
+		if (ipv6_l3fwd_lookup_struct[socketid] != NULL)
+			print_em_table_info(ipv6_l3fwd_lookup_struct[socketid],
+				&ipv6_em_info[socketid]);
+	}
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		for (type = 0; type < EM_LOOKUP_TYPE_MAX; type++) {
+			st = &em_stats[lcore_id].lookup[type];
+			if (st->lookups == 0 && st->cache_hits == 0)
+				continue;
+			printf("lcore %u %-8s", lcore_id, em_lookup_type_name[type]);
+			if (st->cache_hits != 0)
+				printf(" cache hits %"PRIu64, st->cache_hits);
+			if (st->lookups != 0)
+				printf(" lookups %"PRIu64" misses %"PRIu64" (%.1f%%)",
+					st->lookups, st->misses,
+					100.0 * st->misses / st->lookups);
+			if (st->sampled != 0)
+				printf(" sigs/lookup %.2f keys/lookup %.2f max sigs %u",
+					(double)st->sig_cmps / st->sampled,
+					(double)st->key_cmps / st->sampled,
+					st->max_sig_cmps);
+			printf("\n");
+		}
+	}
+	printf("==========================================\n");
+}
+
 /* 
 * Name : print_ipv6_addr
 * Desciption : Prints the IPv6 address
@@ -775,15 +1839,13 @@ apply_nat_and_get_port(struct rte_mbuf *m, struct ipv6_hdr *ipv6_hdr, int index)
 	    	ipv6_hdr->dst_addr[iter] = rule.ip_target[iter];
 
 	/* checksum calculation. */
-	void *transport_header = (void *)(rte_pktmbuf_mtod(m, unsigned char *) +
-	                       sizeof(struct ether_hdr) + sizeof(struct ipv6_hdr));
-
-	compute_checksum(ipv6_hdr, transport_header);
+	compute_checksum(ipv6_hdr, m,
+		sizeof(struct ether_hdr) + sizeof(struct ipv6_hdr));
 	return rule.if_out;
 }
 
 static inline uint8_t
-get_ipv4_dst_port(void *ipv4_hdr, uint8_t portid, lookup_struct_t * ipv4_l3fwd_lookup_struct)
+get_ipv4_dst_port(void *ipv4_hdr, uint8_t portid, struct lcore_conf *qconf)
 {
 	int ret = 0;
 	union ipv4_5tuple_host key;
@@ -793,12 +1855,13 @@ get_ipv4_dst_port(void *ipv4_hdr, uint8_t portid, lookup_struct_t * ipv4_l3fwd_l
 	/* Get 5 tuple: dst port, src port, dst IP address, src IP address and protocol */
 	key.xmm = _mm_and_si128(data, mask0);
 	/* Find destination port */
-	ret = rte_hash_lookup(ipv4_l3fwd_lookup_struct, (const void *)&key);
+	ret = em_lookup(qconf->ipv4_lookup_struct, qconf->ipv4_cache,
+			&key.xmm, 1, EM_LOOKUP_IPV4);
 	return (uint8_t)((ret < 0)? portid : ipv4_l3fwd_out_if[ret]);
 }
 
 static inline uint8_t
-get_ipv6_dst_port(void *ipv6_hdr,  uint8_t portid, lookup_struct_t * ipv6_l3fwd_lookup_struct)
+get_ipv6_dst_port(void *ipv6_hdr,  uint8_t portid, struct lcore_conf *qconf)
 {
 	int ret = 0;
 	union ipv6_5tuple_host key;
@@ -815,7 +1878,8 @@ get_ipv6_dst_port(void *ipv6_hdr,  uint8_t portid, lookup_struct_t * ipv6_l3fwd_
 	key.xmm[2] = _mm_and_si128(data2, mask2);
 
 	/* Find destination port */
-	ret = rte_hash_lookup(ipv6_l3fwd_lookup_struct, (const void *)&key);
+	ret = em_lookup(qconf->ipv6_lookup_struct, qconf->ipv6_cache,
+			key.xmm, XMM_NUM_IN_IPV6_5TUPLE, EM_LOOKUP_IPV6);
 	return (uint8_t)((ret < 0)? portid : ipv6_l3fwd_out_if[ret]);
 }
 
@@ -824,13 +1888,13 @@ get_ipv6_dst_port(void *ipv6_hdr,  uint8_t portid, lookup_struct_t * ipv6_l3fwd_
 * Desciption : Looks up for NAT rules in a hash, which match a given packet
 * Params :
 *	ipv6_hdr - pointer to the ipv6_hdr which should be looked up
-*	ipv6_l3fwd_lookup_struct - pointer to the hash which needs to be looked into
+*	qconf    - lcore configuration holding the hash to be looked into
 * Returns :
 * 	An index into the NAT rules array if there is a match in the hash.
 *	-1 if there is no match
 */
 static inline int
-get_ipv6_nat_rule_index(void *ipv6_hdr, lookup_struct_t * ipv6_l3fwd_lookup_struct)
+get_ipv6_nat_rule_index(void *ipv6_hdr, struct lcore_conf *qconf)
 {
 	int ret = 0;
 	union ipv6_5tuple_host key;
@@ -847,7 +1911,8 @@ get_ipv6_nat_rule_index(void *ipv6_hdr, lookup_struct_t * ipv6_l3fwd_lookup_stru
 	key.xmm[2] = _mm_and_si128(data2, mask4);
 
 	/* Find destination port */
-	ret = rte_hash_lookup(ipv6_l3fwd_lookup_struct, (const void *)&key);
+	ret = em_lookup(qconf->ipv6_lookup_struct, qconf->ipv6_cache,
+			key.xmm, XMM_NUM_IN_IPV6_5TUPLE, EM_LOOKUP_IPV6_NAT);
 
 	return ((ret < 0)? -1 : ret);
 }
@@ -855,169 +1920,319 @@ get_ipv6_nat_rule_index(void *ipv6_hdr, lookup_struct_t * ipv6_l3fwd_lookup_stru
 
 #if (APP_LOOKUP_METHOD == APP_LOOKUP_LPM)
 static inline uint8_t
-get_ipv4_dst_port(void *ipv4_hdr,  uint8_t portid, lookup_struct_t * ipv4_l3fwd_lookup_struct)
+get_ipv4_dst_port(void *ipv4_hdr,  uint8_t portid, struct lcore_conf *qconf)
 {
 	uint8_t next_hop;
 
-	return (uint8_t) ((rte_lpm_lookup(ipv4_l3fwd_lookup_struct,
+	return (uint8_t) ((rte_lpm_lookup(qconf->ipv4_lookup_struct,
 			rte_be_to_cpu_32(((struct ipv4_hdr*)ipv4_hdr)->dst_addr), &next_hop) == 0)?
 			next_hop : portid);
 }
 
 static inline uint8_t
-get_ipv6_dst_port(void *ipv6_hdr,  uint8_t portid, lookup6_struct_t * ipv6_l3fwd_lookup_struct)
+get_ipv6_dst_port(void *ipv6_hdr,  uint8_t portid, struct lcore_conf *qconf)
 {
 	uint8_t next_hop;
-	return (uint8_t) ((rte_lpm6_lookup(ipv6_l3fwd_lookup_struct,
+	return (uint8_t) ((rte_lpm6_lookup(qconf->ipv6_lookup_struct,
 			((struct ipv6_hdr*)ipv6_hdr)->dst_addr, &next_hop) == 0)?
 			next_hop : portid);
 }
 #endif
 
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH) & (ENABLE_MULTI_BUFFER_OPTIMIZE == 1)
-static inline void l3fwd_simple_forward(struct rte_mbuf *m, uint8_t portid, struct lcore_conf *qconf);
+/* Output port of a routed packet, its input port if the route is unusable */
+static inline uint16_t
+checked_dst_port(struct rte_mbuf *m, uint16_t port)
+{
+	if (port >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << port) == 0)
+		return m->pkt.in_port;
+	return port;
+}
 
-#define MASK_ALL_PKTS    0xf
-#define EXECLUDE_1ST_PKT 0xe
-#define EXECLUDE_2ND_PKT 0xd
-#define EXECLUDE_3RD_PKT 0xb
-#define EXECLUDE_4TH_PKT 0x7
+/*
+ * Forwarding graph. A received burst goes from node to node as a vector:
+ * parse splits it by packet type, validate drops the packets that fail
+ * the RFC 1812 checks, ipv4-lookup, ipv6-nat and ipv6-lookup resolve the
+ * output ports of their class (only the IPv6 packets no NAT rule matched
+ * reach ipv6-lookup), rewrite updates the headers of the routed packets,
+ * other drops the non-IP packets and tx queues the vector
+ * by output port. Each node loops over its own vector only, so that its
+ * code stays in the instruction cache for the whole burst, and new stages
+ * are added as nodes without touching the others.
+ */
 
-static inline void 
-simple_ipv4_fwd_4pkts(struct rte_mbuf* m[4], uint8_t portid, struct lcore_conf *qconf)
-{
-	struct ether_hdr *eth_hdr[4];
-	struct ipv4_hdr *ipv4_hdr[4];
-	void *d_addr_bytes[4];
-	uint8_t dst_port[4];
-	int32_t ret[4];
-	union ipv4_5tuple_host key[4];
-	__m128i data[4];
+/* A received burst on its way through the graph, split by packet type */
+struct classified_burst {
+	uint16_t nb_ipv4;
+	uint16_t nb_ipv6;
+	uint16_t nb_other;
+	/* IPv4 packets first, then IPv6 packets, then the others */
+	struct rte_mbuf *pkts[MAX_PKT_BURST];
+	/* output port of each packet, BAD_PORT once dropped */
+	uint16_t dst_port[MAX_PKT_BURST + DST_PORT_PAD];
+};
 
-	eth_hdr[0] = rte_pktmbuf_mtod(m[0], struct ether_hdr *);
-	eth_hdr[1] = rte_pktmbuf_mtod(m[1], struct ether_hdr *);
-	eth_hdr[2] = rte_pktmbuf_mtod(m[2], struct ether_hdr *);
-	eth_hdr[3] = rte_pktmbuf_mtod(m[3], struct ether_hdr *);
+#define PKT_CLASS_IPV4  0
+#define PKT_CLASS_IPV6  1
+#define PKT_CLASS_OTHER 2
 
-	/* Handle IPv4 headers.*/
-	ipv4_hdr[0] = (struct ipv4_hdr *)(rte_pktmbuf_mtod(m[0], unsigned char *) +
-			sizeof(struct ether_hdr));
-	ipv4_hdr[1] = (struct ipv4_hdr *)(rte_pktmbuf_mtod(m[1], unsigned char *) +
-			sizeof(struct ether_hdr));
-	ipv4_hdr[2] = (struct ipv4_hdr *)(rte_pktmbuf_mtod(m[2], unsigned char *) +
-			sizeof(struct ether_hdr));
-	ipv4_hdr[3] = (struct ipv4_hdr *)(rte_pktmbuf_mtod(m[3], unsigned char *) +
-			sizeof(struct ether_hdr));
+/*
+ * parse: split a burst into IPv4, IPv6 and other packets, keeping the
+ * receive order within each class. The packet type flags set by the PMD
+ * are used when present, the ether_type is checked otherwise; either way
+ * the headers are prefetched for the nodes that follow. Unless the burst
+ * was gathered from several ports (RX_PORT_MIXED), every packet is tagged
+ * with portid: the lookups take the input port from the mbuf.
+ */
+static inline void
+classify_burst(struct rte_mbuf **pkts, int nb_rx, uint8_t portid,
+	struct classified_burst *cb)
+{
+	struct ether_hdr *eth_hdr;
+	uint8_t pkt_class[MAX_PKT_BURST];
+	uint16_t ol_flags, pos[PKT_CLASS_OTHER + 1];
+	int i;
 
-#ifdef DO_RFC_1812_CHECKS
-	/* Check to make sure the packet is valid (RFC1812) */
-	uint8_t valid_mask = MASK_ALL_PKTS;
-	if (is_valid_ipv4_pkt(ipv4_hdr[0], m[0]->pkt.pkt_len) < 0) {
-		rte_pktmbuf_free(m[0]);
-		valid_mask &= EXECLUDE_1ST_PKT;
-	}
-	if (is_valid_ipv4_pkt(ipv4_hdr[1], m[1]->pkt.pkt_len) < 0) {
-		rte_pktmbuf_free(m[1]);
-		valid_mask &= EXECLUDE_2ND_PKT;
-	}
-	if (is_valid_ipv4_pkt(ipv4_hdr[2], m[2]->pkt.pkt_len) < 0) {
-		rte_pktmbuf_free(m[2]);
-		valid_mask &= EXECLUDE_3RD_PKT;
-	}
-	if (is_valid_ipv4_pkt(ipv4_hdr[3], m[3]->pkt.pkt_len) < 0) {
-		rte_pktmbuf_free(m[3]);
-		valid_mask &= EXECLUDE_4TH_PKT;
-	}
-	if (unlikely(valid_mask != MASK_ALL_PKTS)) {
-		if (valid_mask == 0){
-			return;
+	pos[PKT_CLASS_IPV4] = 0;
+	pos[PKT_CLASS_IPV6] = 0;
+	pos[PKT_CLASS_OTHER] = 0;
+
+	for (i = 0; i < PREFETCH_OFFSET && i < nb_rx; i++)
+		rte_prefetch0(rte_pktmbuf_mtod(pkts[i], void *));
+
+	for (i = 0; i < nb_rx; i++) {
+		if (i + PREFETCH_OFFSET < nb_rx)
+			rte_prefetch0(rte_pktmbuf_mtod(pkts[i + PREFETCH_OFFSET],
+				void *));
+		eth_hdr = rte_pktmbuf_mtod(pkts[i], struct ether_hdr *);
+		if (portid != RX_PORT_MIXED)
+			pkts[i]->pkt.in_port = portid;
+		ol_flags = pkts[i]->ol_flags;
+		if (ol_flags & (PKT_RX_IPV4_HDR | PKT_RX_IPV4_HDR_EXT)) {
+			pkt_class[i] = PKT_CLASS_IPV4;
+		} else if (ol_flags & (PKT_RX_IPV6_HDR | PKT_RX_IPV6_HDR_EXT)) {
+			pkt_class[i] = PKT_CLASS_IPV6;
 		} else {
-			uint8_t i = 0;
-			for (i = 0; i < 4; i++) {
-				if ((0x1 << i) & valid_mask) {
-					l3fwd_simple_forward(m[i], portid, qconf);
-				}
-			}
-			return;
+			if (eth_hdr->ether_type == rte_cpu_to_be_16(IPV4_PKT_TYPE))
+				pkt_class[i] = PKT_CLASS_IPV4;
+			else if (eth_hdr->ether_type == rte_cpu_to_be_16(IPV6_PKT_TYPE))
+				pkt_class[i] = PKT_CLASS_IPV6;
+			else
+				pkt_class[i] = PKT_CLASS_OTHER;
 		}
+		pos[pkt_class[i]]++;
 	}
-#endif // End of #ifdef DO_RFC_1812_CHECKS
 
-	data[0] = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m[0], unsigned char *) +
-		sizeof(struct ether_hdr) + offsetof(struct ipv4_hdr, time_to_live)));
-	data[1] = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m[1], unsigned char *) +
-		sizeof(struct ether_hdr) + offsetof(struct ipv4_hdr, time_to_live)));
-	data[2] = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m[2], unsigned char *) +
-		sizeof(struct ether_hdr) + offsetof(struct ipv4_hdr, time_to_live)));
-	data[3] = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m[3], unsigned char *) +
-		sizeof(struct ether_hdr) + offsetof(struct ipv4_hdr, time_to_live)));
+	cb->nb_ipv4 = pos[PKT_CLASS_IPV4];
+	cb->nb_ipv6 = pos[PKT_CLASS_IPV6];
+	cb->nb_other = pos[PKT_CLASS_OTHER];
 
-	key[0].xmm = _mm_and_si128(data[0], mask0);
-	key[1].xmm = _mm_and_si128(data[1], mask0);
-	key[2].xmm = _mm_and_si128(data[2], mask0);
-	key[3].xmm = _mm_and_si128(data[3], mask0);
+	/* turn the counts into the start of each class */
+	pos[PKT_CLASS_OTHER] = cb->nb_ipv4 + cb->nb_ipv6;
+	pos[PKT_CLASS_IPV6] = cb->nb_ipv4;
+	pos[PKT_CLASS_IPV4] = 0;
 
-	const void *key_array[4] = {&key[0], &key[1], &key[2],&key[3]};
-	rte_hash_lookup_multi(qconf->ipv4_lookup_struct, &key_array[0], 4, ret);
-	dst_port[0] = (uint8_t) ((ret[0] < 0) ? portid : ipv4_l3fwd_out_if[ret[0]]);
-	dst_port[1] = (uint8_t) ((ret[1] < 0) ? portid : ipv4_l3fwd_out_if[ret[1]]);
-	dst_port[2] = (uint8_t) ((ret[2] < 0) ? portid : ipv4_l3fwd_out_if[ret[2]]);
-	dst_port[3] = (uint8_t) ((ret[3] < 0) ? portid : ipv4_l3fwd_out_if[ret[3]]);
-	
-	if (dst_port[0] >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port[0]) == 0)
-		dst_port[0] = portid;
-	if (dst_port[1] >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port[1]) == 0)
-		dst_port[1] = portid;
-	if (dst_port[2] >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port[2]) == 0)
-		dst_port[2] = portid;
-	if (dst_port[3] >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port[3]) == 0)
-		dst_port[3] = portid;
-
-	/* 02:00:00:00:00:xx */
-	d_addr_bytes[0] = &eth_hdr[0]->d_addr.addr_bytes[0];
-	d_addr_bytes[1] = &eth_hdr[1]->d_addr.addr_bytes[0];
-	d_addr_bytes[2] = &eth_hdr[2]->d_addr.addr_bytes[0];
-	d_addr_bytes[3] = &eth_hdr[3]->d_addr.addr_bytes[0];
-	*((uint64_t *)d_addr_bytes[0]) = 0x000000000002 + ((uint64_t)dst_port[0] << 40);
-	*((uint64_t *)d_addr_bytes[1]) = 0x000000000002 + ((uint64_t)dst_port[1] << 40);
-	*((uint64_t *)d_addr_bytes[2]) = 0x000000000002 + ((uint64_t)dst_port[2] << 40);
-	*((uint64_t *)d_addr_bytes[3]) = 0x000000000002 + ((uint64_t)dst_port[3] << 40);
-
-#ifdef DO_RFC_1812_CHECKS
-	/* Update time to live and header checksum */
-	--(ipv4_hdr[0]->time_to_live);
-	--(ipv4_hdr[1]->time_to_live);
-	--(ipv4_hdr[2]->time_to_live);
-	--(ipv4_hdr[3]->time_to_live);
-	++(ipv4_hdr[0]->hdr_checksum);
-	++(ipv4_hdr[1]->hdr_checksum);
-	++(ipv4_hdr[2]->hdr_checksum);
-	++(ipv4_hdr[3]->hdr_checksum);
+	for (i = 0; i < nb_rx; i++)
+		cb->pkts[pos[pkt_class[i]]++] = pkts[i];
+}
+
+/*
+ * validate: drop the IPv4 and IPv6 packets of a classified burst that
+ * fail the RFC 1812 checks and close the gaps they leave. Only the IP
+ * versions in flags are checked. Returns the number of packets left.
+ */
+static inline __attribute__((always_inline)) int
+drop_invalid_classified(struct classified_burst *cb, struct lcore_conf *qconf,
+	const unsigned flags)
+{
+	struct rte_mbuf **ipv6_pkts = cb->pkts + cb->nb_ipv4;
+	struct rte_mbuf **other_pkts = ipv6_pkts + cb->nb_ipv6;
+	int nb_ipv4, nb_ipv6;
+
+	nb_ipv4 = cb->nb_ipv4;
+	if (flags & FWD_F_IPV4)
+		nb_ipv4 = drop_invalid_pkts(qconf, cb->pkts, cb->nb_ipv4, 0);
+	nb_ipv6 = cb->nb_ipv6;
+	if (flags & FWD_F_IPV6)
+		nb_ipv6 = drop_invalid_pkts(qconf, ipv6_pkts, cb->nb_ipv6,
+			1);
+
+	if (unlikely(nb_ipv4 != cb->nb_ipv4))
+		memmove(cb->pkts + nb_ipv4, ipv6_pkts,
+			nb_ipv6 * sizeof(cb->pkts[0]));
+	if (unlikely(nb_ipv4 + nb_ipv6 != cb->nb_ipv4 + cb->nb_ipv6))
+		memmove(cb->pkts + nb_ipv4 + nb_ipv6, other_pkts,
+			cb->nb_other * sizeof(cb->pkts[0]));
+
+	cb->nb_ipv4 = (uint16_t)nb_ipv4;
+	cb->nb_ipv6 = (uint16_t)nb_ipv6;
+	return nb_ipv4 + nb_ipv6 + cb->nb_other;
+}
+
+/* Number of packets whose headers are prefetched ahead of the one forwarded */
+#define MULTI_PREFETCH_AHEAD 4
+
+/*
+ * Prefetch the headers of pkts[first] up to (not including) pkts[last],
+ * clamped to nb. IPv6 packets get their second cache line prefetched as
+ * well: it holds the L4 header that NAT rewrites.
+ */
+static inline void
+prefetch_pkt_hdrs(struct rte_mbuf **pkts, int first, int last, int nb,
+	const int nb_lines)
+{
+	uint8_t *hdr;
+
+	if (last > nb)
+		last = nb;
+	for (; first < last; first++) {
+		hdr = rte_pktmbuf_mtod(pkts[first], uint8_t *);
+		rte_prefetch0(hdr);
+		if (nb_lines > 1)
+			rte_prefetch0(hdr + CACHE_LINE_SIZE);
+	}
+}
+
+/*
+ * Lookup kernels: resolve the output ports of a vector of packets of one
+ * IP version into dst_port[] without modifying the packets. Every ISA has
+ * its own, they are inlined into the graph of the variants of that ISA.
+ * The graph has prefetched the headers of the first MULTI_PREFETCH_AHEAD
+ * packets; each kernel prefetches the next group while it looks up the
+ * current one.
+ */
+typedef void (*fwd_lookup_t)(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, uint16_t *dst_port);
+
+/*
+ * NAT kernels: find the NAT rule of each packet of a vector of IPv6
+ * packets, -1 if none matches, see ipv6_nat_apply().
+ */
+typedef void (*fwd_nat_t)(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, int32_t *rule);
+
+static inline __attribute__((always_inline)) void
+ipv4_lookup_scalar(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, uint16_t *dst_port)
+{
+	int j;
+
+	for (j = 0; j < nb; j++) {
+		prefetch_pkt_hdrs(pkts, j + MULTI_PREFETCH_AHEAD,
+			j + MULTI_PREFETCH_AHEAD + 1, nb, 1);
+		dst_port[j] = checked_dst_port(pkts[j], get_ipv4_dst_port(
+			rte_pktmbuf_mtod(pkts[j], unsigned char *) +
+			sizeof(struct ether_hdr), pkts[j]->pkt.in_port, qconf));
+	}
+}
+
+static inline __attribute__((always_inline)) void
+ipv6_lookup_scalar(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, uint16_t *dst_port)
+{
+	int j;
+
+	for (j = 0; j < nb; j++) {
+		prefetch_pkt_hdrs(pkts, j + MULTI_PREFETCH_AHEAD,
+			j + MULTI_PREFETCH_AHEAD + 1, nb, 2);
+		dst_port[j] = checked_dst_port(pkts[j], get_ipv6_dst_port(
+			rte_pktmbuf_mtod(pkts[j], unsigned char *) +
+			sizeof(struct ether_hdr), pkts[j]->pkt.in_port, qconf));
+	}
+}
+
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+static inline __attribute__((always_inline)) void
+ipv6_nat_scalar(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, int32_t *rule)
+{
+	int j;
+
+	for (j = 0; j < nb; j++) {
+		prefetch_pkt_hdrs(pkts, j + MULTI_PREFETCH_AHEAD,
+			j + MULTI_PREFETCH_AHEAD + 1, nb, 2);
+		rule[j] = get_ipv6_nat_rule_index(rte_pktmbuf_mtod(pkts[j],
+			unsigned char *) + sizeof(struct ether_hdr), qconf);
+	}
+}
+
+/*
+ * ipv6-nat: apply the rules the NAT kernel found and move the packets no
+ * rule matched to the front of the vector, keeping their order. Returns
+ * their number: only those go on to ipv6-lookup.
+ */
+static inline int
+ipv6_nat_apply(struct rte_mbuf **pkts, int nb, const int32_t *rule,
+	uint16_t *dst_port)
+{
+	struct rte_mbuf *nat_pkts[MAX_PKT_BURST];
+	uint16_t nat_port[MAX_PKT_BURST];
+	struct ipv6_hdr *ipv6_hdr;
+	int j, n = 0, n_nat = 0;
+
+	for (j = 0; j < nb; j++) {
+		if (rule[j] < 0) {
+			pkts[n++] = pkts[j];
+			continue;
+		}
+		ipv6_hdr = (struct ipv6_hdr *)(rte_pktmbuf_mtod(pkts[j],
+			unsigned char *) + sizeof(struct ether_hdr));
+		nat_port[n_nat] = checked_dst_port(pkts[j],
+			apply_nat_and_get_port(pkts[j], ipv6_hdr, rule[j]));
+		nat_pkts[n_nat++] = pkts[j];
+	}
+
+	if (n_nat != 0) {
+		rte_memcpy(&pkts[n], nat_pkts, n_nat * sizeof(pkts[0]));
+		rte_memcpy(&dst_port[n], nat_port, n_nat * sizeof(dst_port[0]));
+	}
+	return n;
+}
 #endif
 
-	/* src addr */
-	ether_addr_copy(&ports_eth_addr[dst_port[0]], &eth_hdr[0]->s_addr);
-	ether_addr_copy(&ports_eth_addr[dst_port[1]], &eth_hdr[1]->s_addr);
-	ether_addr_copy(&ports_eth_addr[dst_port[2]], &eth_hdr[2]->s_addr);
-	ether_addr_copy(&ports_eth_addr[dst_port[3]], &eth_hdr[3]->s_addr);
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH) & (ENABLE_MULTI_BUFFER_OPTIMIZE == 1)
+/* The SSE kernels look the keys of four packets up at once */
+static inline __attribute__((always_inline)) void
+ipv4_lookup_4pkts(struct rte_mbuf *m[4], struct lcore_conf *qconf,
+	uint16_t dst_port[4])
+{
+	int32_t ret[4];
+	union ipv4_5tuple_host key[4];
+	__m128i data[4];
+	int i;
+
+	data[0] = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m[0], unsigned char *) +
+		sizeof(struct ether_hdr) + offsetof(struct ipv4_hdr, time_to_live)));
+	data[1] = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m[1], unsigned char *) +
+		sizeof(struct ether_hdr) + offsetof(struct ipv4_hdr, time_to_live)));
+	data[2] = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m[2], unsigned char *) +
+		sizeof(struct ether_hdr) + offsetof(struct ipv4_hdr, time_to_live)));
+	data[3] = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m[3], unsigned char *) +
+		sizeof(struct ether_hdr) + offsetof(struct ipv4_hdr, time_to_live)));
+
+	key[0].xmm = _mm_and_si128(data[0], mask0);
+	key[1].xmm = _mm_and_si128(data[1], mask0);
+	key[2].xmm = _mm_and_si128(data[2], mask0);
+	key[3].xmm = _mm_and_si128(data[3], mask0);
 
-	send_single_packet(m[0], (uint8_t)dst_port[0]);
-	send_single_packet(m[1], (uint8_t)dst_port[1]);
-	send_single_packet(m[2], (uint8_t)dst_port[2]);
-	send_single_packet(m[3], (uint8_t)dst_port[3]);
+	const void *key_array[4] = {&key[0], &key[1], &key[2],&key[3]};
+	em_lookup_multi(qconf->ipv4_lookup_struct, qconf->ipv4_cache,
+		&key_array[0], 4, 1, ret, EM_LOOKUP_IPV4);
 
+	for (i = 0; i < 4; i++)
+		dst_port[i] = checked_dst_port(m[i], (ret[i] < 0) ?
+			m[i]->pkt.in_port : ipv4_l3fwd_out_if[ret[i]]);
 }
 
 static inline void get_ipv6_5tuple(struct rte_mbuf* m0, __m128i mask0, __m128i mask1,
 				 union ipv6_5tuple_host * key)
 {
-        __m128i tmpdata0 = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m0, unsigned char *) 
+        __m128i tmpdata0 = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m0, unsigned char *)
 			+ sizeof(struct ether_hdr) + offsetof(struct ipv6_hdr, payload_len)));
-        __m128i tmpdata1 = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m0, unsigned char *) 
-			+ sizeof(struct ether_hdr) + offsetof(struct ipv6_hdr, payload_len) 
+        __m128i tmpdata1 = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m0, unsigned char *)
+			+ sizeof(struct ether_hdr) + offsetof(struct ipv6_hdr, payload_len)
 			+  sizeof(__m128i)));
-        __m128i tmpdata2 = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m0, unsigned char *) 
-			+ sizeof(struct ether_hdr) + offsetof(struct ipv6_hdr, payload_len) 
+        __m128i tmpdata2 = _mm_loadu_si128((__m128i*)(rte_pktmbuf_mtod(m0, unsigned char *)
+			+ sizeof(struct ether_hdr) + offsetof(struct ipv6_hdr, payload_len)
 			+ sizeof(__m128i) + sizeof(__m128i)));
         key->xmm[0] = _mm_and_si128(tmpdata0, mask0);
         key->xmm[1] = tmpdata1;
@@ -1025,151 +2240,1664 @@ static inline void get_ipv6_5tuple(struct rte_mbuf* m0, __m128i mask0, __m128i m
 	return;
 }
 
-static inline void 
-simple_ipv6_fwd_4pkts(struct rte_mbuf* m[4], uint8_t portid, struct lcore_conf *qconf)
+static inline __attribute__((always_inline)) void
+ipv6_lookup_4pkts(struct rte_mbuf *m[4], struct lcore_conf *qconf,
+	uint16_t dst_port[4])
 {
-	struct ether_hdr *eth_hdr[4];
-	__attribute__((unused)) struct ipv6_hdr *ipv6_hdr[4];
-	int lookup_index[4] = {-1};
-	void *d_addr_bytes[4];
-	uint8_t dst_port[4];
-	int count;
+	int32_t ret[4];
+	union ipv6_5tuple_host key[4];
+	int i;
 
-	eth_hdr[0] = rte_pktmbuf_mtod(m[0], struct ether_hdr *);
-	eth_hdr[1] = rte_pktmbuf_mtod(m[1], struct ether_hdr *);
-	eth_hdr[2] = rte_pktmbuf_mtod(m[2], struct ether_hdr *);
-	eth_hdr[3] = rte_pktmbuf_mtod(m[3], struct ether_hdr *);
+	get_ipv6_5tuple(m[0], mask1, mask2, &key[0]);
+	get_ipv6_5tuple(m[1], mask1, mask2, &key[1]);
+	get_ipv6_5tuple(m[2], mask1, mask2, &key[2]);
+	get_ipv6_5tuple(m[3], mask1, mask2, &key[3]);
 
-	/* Handle IPv6 headers.*/
-	ipv6_hdr[0] = (struct ipv6_hdr *)(rte_pktmbuf_mtod(m[0], unsigned char *) +
-			sizeof(struct ether_hdr));
-	ipv6_hdr[1] = (struct ipv6_hdr *)(rte_pktmbuf_mtod(m[1], unsigned char *) +
-			sizeof(struct ether_hdr));
-	ipv6_hdr[2] = (struct ipv6_hdr *)(rte_pktmbuf_mtod(m[2], unsigned char *) +
-			sizeof(struct ether_hdr));
-	ipv6_hdr[3] = (struct ipv6_hdr *)(rte_pktmbuf_mtod(m[3], unsigned char *) +
-			sizeof(struct ether_hdr));
+	const void *key_array[4] = {&key[0], &key[1], &key[2], &key[3]};
+	em_lookup_multi(qconf->ipv6_lookup_struct, qconf->ipv6_cache,
+		&key_array[0], 4, XMM_NUM_IN_IPV6_5TUPLE, ret, EM_LOOKUP_IPV6);
 
-	for(count=0; count<4; count++) {
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)              
-		lookup_index[count] = get_ipv6_nat_rule_index(ipv6_hdr[count], qconf->ipv6_lookup_struct);
-#endif /* APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH */
-		if(lookup_index[count] == -1) {
-			dst_port[count] = get_ipv6_dst_port(ipv6_hdr[count], portid, qconf->ipv6_lookup_struct);
-		}	
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)              
-		else {
-			dst_port[count] = apply_nat_and_get_port(m[count], ipv6_hdr[count], lookup_index[count]);
-		}	 
-#endif /* (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH) */           
-	}
-
-	if (dst_port[0] >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port[0]) == 0)
-		dst_port[0] = portid;
-	if (dst_port[1] >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port[1]) == 0)
-		dst_port[1] = portid;
-	if (dst_port[2] >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port[2]) == 0)
-		dst_port[2] = portid;
-	if (dst_port[3] >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port[3]) == 0)
-		dst_port[3] = portid;
-
-	/* 02:00:00:00:00:xx */
-	d_addr_bytes[0] = &eth_hdr[0]->d_addr.addr_bytes[0];
-	d_addr_bytes[1] = &eth_hdr[1]->d_addr.addr_bytes[0];
-	d_addr_bytes[2] = &eth_hdr[2]->d_addr.addr_bytes[0];
-	d_addr_bytes[3] = &eth_hdr[3]->d_addr.addr_bytes[0];
-	*((uint64_t *)d_addr_bytes[0]) = 0x000000000002 + ((uint64_t)dst_port[0] << 40);
-	*((uint64_t *)d_addr_bytes[1]) = 0x000000000002 + ((uint64_t)dst_port[1] << 40);
-	*((uint64_t *)d_addr_bytes[2]) = 0x000000000002 + ((uint64_t)dst_port[2] << 40);
-	*((uint64_t *)d_addr_bytes[3]) = 0x000000000002 + ((uint64_t)dst_port[3] << 40);
-
-	/* src addr */
-	ether_addr_copy(&ports_eth_addr[dst_port[0]], &eth_hdr[0]->s_addr);
-	ether_addr_copy(&ports_eth_addr[dst_port[1]], &eth_hdr[1]->s_addr);
-	ether_addr_copy(&ports_eth_addr[dst_port[2]], &eth_hdr[2]->s_addr);
-	ether_addr_copy(&ports_eth_addr[dst_port[3]], &eth_hdr[3]->s_addr);
-
-	send_single_packet(m[0], (uint8_t)dst_port[0]);
-	send_single_packet(m[1], (uint8_t)dst_port[1]);
-	send_single_packet(m[2], (uint8_t)dst_port[2]);
-	send_single_packet(m[3], (uint8_t)dst_port[3]);
-
-}
-#endif // End of #if(APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)&(ENABLE_MULTI_BUFFER_OPTIMIZE == 1)
+	for (i = 0; i < 4; i++)
+		dst_port[i] = checked_dst_port(m[i], (ret[i] < 0) ?
+			m[i]->pkt.in_port : ipv6_l3fwd_out_if[ret[i]]);
+}
+
+static inline __attribute__((always_inline)) void
+ipv6_nat_4pkts(struct rte_mbuf *m[4], struct lcore_conf *qconf,
+	int32_t rule[4])
+{
+	union ipv6_5tuple_host key[4];
+
+	get_ipv6_5tuple(m[0], mask3, mask4, &key[0]);
+	get_ipv6_5tuple(m[1], mask3, mask4, &key[1]);
+	get_ipv6_5tuple(m[2], mask3, mask4, &key[2]);
+	get_ipv6_5tuple(m[3], mask3, mask4, &key[3]);
+
+	const void *key_array[4] = {&key[0], &key[1], &key[2], &key[3]};
+	em_lookup_multi(qconf->ipv6_lookup_struct, qconf->ipv6_cache,
+		&key_array[0], 4, XMM_NUM_IN_IPV6_5TUPLE, rule,
+		EM_LOOKUP_IPV6_NAT);
+}
+
+static inline __attribute__((always_inline)) void
+ipv4_lookup_sse(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, uint16_t *dst_port)
+{
+	int j, n = RTE_ALIGN_FLOOR(nb, 4);
+
+	for (j = 0; j < n; j += 4) {
+		prefetch_pkt_hdrs(pkts, j + 4, j + 8, nb, 1);
+		ipv4_lookup_4pkts(&pkts[j], qconf, &dst_port[j]);
+	}
+	ipv4_lookup_scalar(&pkts[j], nb - j, qconf, &dst_port[j]);
+}
+
+static inline __attribute__((always_inline)) void
+ipv6_lookup_sse(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, uint16_t *dst_port)
+{
+	int j, n = RTE_ALIGN_FLOOR(nb, 4);
+
+	for (j = 0; j < n; j += 4) {
+		prefetch_pkt_hdrs(pkts, j + 4, j + 8, nb, 2);
+		ipv6_lookup_4pkts(&pkts[j], qconf, &dst_port[j]);
+	}
+	ipv6_lookup_scalar(&pkts[j], nb - j, qconf, &dst_port[j]);
+}
+
+static inline __attribute__((always_inline)) void
+ipv6_nat_sse(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, int32_t *rule)
+{
+	int j, n = RTE_ALIGN_FLOOR(nb, 4);
+
+	for (j = 0; j < n; j += 4) {
+		prefetch_pkt_hdrs(pkts, j + 4, j + 8, nb, 2);
+		ipv6_nat_4pkts(&pkts[j], qconf, &rule[j]);
+	}
+	ipv6_nat_scalar(&pkts[j], nb - j, qconf, &rule[j]);
+}
+
+#ifdef L3FWD_AVX2_KERNELS
+/* The AVX2 kernels build the keys of two packets per register */
+static inline __attribute__((always_inline)) __l3fwd_avx2 void
+ipv4_lookup_8pkts_avx2(struct rte_mbuf *m[8], struct lcore_conf *qconf,
+	uint16_t dst_port[8])
+{
+	struct ipv4_hdr *ipv4_hdr[8];
+	union ipv4_5tuple_host key[8];
+	const void *key_array[8];
+	int32_t ret[8];
+	__m256i data;
+	const __m256i key_mask = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(mask0), mask0, 1);
+	int i;
+
+	for (i = 0; i < 8; i++)
+		ipv4_hdr[i] = (struct ipv4_hdr *)(rte_pktmbuf_mtod(m[i],
+			unsigned char *) + sizeof(struct ether_hdr));
+
+	/* 16 bytes from time_to_live on, packet 2i low and 2i+1 high */
+	for (i = 0; i < 4; i++) {
+		data = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((__m128i *)&ipv4_hdr[2 * i]->time_to_live)),
+			_mm_loadu_si128((__m128i *)&ipv4_hdr[2 * i + 1]->time_to_live), 1);
+		_mm256_storeu_si256((__m256i *)&key[2 * i],
+			_mm256_and_si256(data, key_mask));
+	}
+
+	for (i = 0; i < 8; i++)
+		key_array[i] = &key[i];
+	em_lookup_multi(qconf->ipv4_lookup_struct, qconf->ipv4_cache,
+		key_array, 8, 1, ret, EM_LOOKUP_IPV4);
+
+	for (i = 0; i < 8; i++)
+		dst_port[i] = checked_dst_port(m[i], (ret[i] < 0) ?
+			m[i]->pkt.in_port : ipv4_l3fwd_out_if[ret[i]]);
+}
+
+/*
+ * Key of an IPv6 packet masked from one 32 byte and one 16 byte load, the
+ * route key with mask_lo/mask2, the NAT key with mask_lo/mask4.
+ */
+static inline __attribute__((always_inline)) __l3fwd_avx2 void
+get_ipv6_5tuple_avx2(struct rte_mbuf *m, __m256i mask_lo, __m128i mask_hi,
+	union ipv6_5tuple_host *key)
+{
+	const uint8_t *p = rte_pktmbuf_mtod(m, uint8_t *) +
+		sizeof(struct ether_hdr) + offsetof(struct ipv6_hdr, payload_len);
+
+	_mm256_storeu_si256((__m256i *)&key->xmm[0], _mm256_and_si256(
+		_mm256_loadu_si256((const __m256i *)p), mask_lo));
+	key->xmm[2] = _mm_and_si128(_mm_loadu_si128((const __m128i *)(p +
+		2 * sizeof(__m128i))), mask_hi);
+}
+
+static inline __attribute__((always_inline)) __l3fwd_avx2 void
+ipv6_lookup_8pkts_avx2(struct rte_mbuf *m[8], struct lcore_conf *qconf,
+	uint16_t dst_port[8])
+{
+	union ipv6_5tuple_host key[8];
+	const void *key_array[8];
+	int32_t ret[8];
+	const __m256i route_mask = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(mask1), _mm_set1_epi32(-1), 1);
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		get_ipv6_5tuple_avx2(m[i], route_mask, mask2, &key[i]);
+		key_array[i] = &key[i];
+	}
+	em_lookup_multi(qconf->ipv6_lookup_struct, qconf->ipv6_cache,
+		key_array, 8, XMM_NUM_IN_IPV6_5TUPLE, ret, EM_LOOKUP_IPV6);
+
+	for (i = 0; i < 8; i++)
+		dst_port[i] = checked_dst_port(m[i], (ret[i] < 0) ?
+			m[i]->pkt.in_port : ipv6_l3fwd_out_if[ret[i]]);
+}
+
+static inline __attribute__((always_inline)) __l3fwd_avx2 void
+ipv6_nat_8pkts_avx2(struct rte_mbuf *m[8], struct lcore_conf *qconf,
+	int32_t rule[8])
+{
+	union ipv6_5tuple_host key[8];
+	const void *key_array[8];
+	const __m256i nat_mask = _mm256_inserti128_si256(
+		_mm256_castsi128_si256(mask3), _mm_set1_epi32(-1), 1);
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		get_ipv6_5tuple_avx2(m[i], nat_mask, mask4, &key[i]);
+		key_array[i] = &key[i];
+	}
+	em_lookup_multi(qconf->ipv6_lookup_struct, qconf->ipv6_cache,
+		key_array, 8, XMM_NUM_IN_IPV6_5TUPLE, rule, EM_LOOKUP_IPV6_NAT);
+}
+
+static inline __attribute__((always_inline)) __l3fwd_avx2 void
+ipv4_lookup_avx2(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, uint16_t *dst_port)
+{
+	int j, n = RTE_ALIGN_FLOOR(nb, 8);
+
+	prefetch_pkt_hdrs(pkts, MULTI_PREFETCH_AHEAD, 8, nb, 1);
+	for (j = 0; j < n; j += 8) {
+		prefetch_pkt_hdrs(pkts, j + 8, j + 16, nb, 1);
+		ipv4_lookup_8pkts_avx2(&pkts[j], qconf, &dst_port[j]);
+	}
+	ipv4_lookup_sse(&pkts[j], nb - j, qconf, &dst_port[j]);
+}
+
+static inline __attribute__((always_inline)) __l3fwd_avx2 void
+ipv6_lookup_avx2(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, uint16_t *dst_port)
+{
+	int j, n = RTE_ALIGN_FLOOR(nb, 8);
+
+	prefetch_pkt_hdrs(pkts, MULTI_PREFETCH_AHEAD, 8, nb, 2);
+	for (j = 0; j < n; j += 8) {
+		prefetch_pkt_hdrs(pkts, j + 8, j + 16, nb, 2);
+		ipv6_lookup_8pkts_avx2(&pkts[j], qconf, &dst_port[j]);
+	}
+	ipv6_lookup_sse(&pkts[j], nb - j, qconf, &dst_port[j]);
+}
+
+static inline __attribute__((always_inline)) __l3fwd_avx2 void
+ipv6_nat_avx2(struct rte_mbuf **pkts, int nb,
+	struct lcore_conf *qconf, int32_t *rule)
+{
+	int j, n = RTE_ALIGN_FLOOR(nb, 8);
+
+	prefetch_pkt_hdrs(pkts, MULTI_PREFETCH_AHEAD, 8, nb, 2);
+	for (j = 0; j < n; j += 8) {
+		prefetch_pkt_hdrs(pkts, j + 8, j + 16, nb, 2);
+		ipv6_nat_8pkts_avx2(&pkts[j], qconf, &rule[j]);
+	}
+	ipv6_nat_sse(&pkts[j], nb - j, qconf, &rule[j]);
+}
+#endif /* L3FWD_AVX2_KERNELS */
+#endif /* (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH) & (ENABLE_MULTI_BUFFER_OPTIMIZE == 1) */
 
+/*
+ * rewrite: write the L2 header of routed packets for their output port
+ * and, with the RFC 1812 checks on, update the TTL and header checksum of
+ * IPv4 packets or the hop limit of IPv6 ones.
+ */
 static inline __attribute__((always_inline)) void
-l3fwd_simple_forward(struct rte_mbuf *m, uint8_t portid, struct lcore_conf *qconf)
+rewrite_pkts(struct rte_mbuf **pkts, int nb, const uint16_t *dst_port,
+	const int ipv6, const unsigned flags)
 {
 	struct ether_hdr *eth_hdr;
 	struct ipv4_hdr *ipv4_hdr;
-	void *d_addr_bytes;
-	uint8_t dst_port;
+	int j;
+
+	for (j = 0; j < nb; j++) {
+		eth_hdr = rte_pktmbuf_mtod(pkts[j], struct ether_hdr *);
+		if ((flags & FWD_F_RFC1812) && ipv6) {
+			--(((struct ipv6_hdr *)(eth_hdr + 1))->hop_limits);
+		} else if (flags & FWD_F_RFC1812) {
+			ipv4_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+			--(ipv4_hdr->time_to_live);
+			++(ipv4_hdr->hdr_checksum);
+		}
+		rewrite_l2_hdr(eth_hdr, dst_port[j]);
+	}
+}
 
-	eth_hdr = rte_pktmbuf_mtod(m, struct ether_hdr *);
-	if (ntohs(eth_hdr->ether_type) & IPV4_PKT_TYPE) {
-		/* Handle IPv4 headers.*/
-		ipv4_hdr = (struct ipv4_hdr *)(rte_pktmbuf_mtod(m, unsigned char *) +
-				sizeof(struct ether_hdr));
-
-#ifdef DO_RFC_1812_CHECKS
-		/* Check to make sure the packet is valid (RFC1812) */
-		if (is_valid_ipv4_pkt(ipv4_hdr, m->pkt.pkt_len) < 0) {
-			rte_pktmbuf_free(m);
-			return;
+/* Free the packets of a class this variant does not forward */
+static inline void
+drop_pkts(struct rte_mbuf **pkts, int nb, struct lcore_conf *qconf,
+	uint16_t *dst_port)
+{
+	int j;
+
+	free_dropped_pkts(qconf, pkts, (uint16_t)nb);
+	for (j = 0; j < nb; j++)
+		dst_port[j] = BAD_PORT;
+}
+
+/*
+ * other: the packets parse found to be neither IPv4 nor IPv6 (ARP, VLAN
+ * tagged, LLDP...) have no header to route by, they are dropped and
+ * counted.
+ */
+static inline void
+drop_other_pkts(struct rte_mbuf **pkts, int nb, struct lcore_conf *qconf,
+	uint16_t *dst_port)
+{
+	drop_pkts(pkts, nb, qconf, dst_port);
+	qconf->non_ip_dropped += nb;
+}
+
+/* Start of a graph run: the cycle counter, or 0 without --node-cycles */
+static inline uint64_t
+fwd_node_start(void)
+{
+	return unlikely(node_cycles) ? rte_rdtsc() : 0;
+}
+
+/*
+ * Account a node that processed nb packets since tsc, returns the time it
+ * ended at: the start of the next node.
+ */
+static inline uint64_t
+fwd_node_done(struct lcore_conf *qconf, enum fwd_node node, int nb,
+	uint64_t tsc)
+{
+	struct fwd_node_stats *ns = &qconf->node_stats[node];
+	uint64_t now;
+
+	ns->calls++;
+	ns->pkts += nb;
+	if (likely(!node_cycles))
+		return 0;
+	now = rte_rdtsc();
+	ns->cycles += now - tsc;
+	return now;
+}
+
+/*
+ * Run a burst received on one port, or gathered from several with portid
+ * RX_PORT_MIXED, through the forwarding graph. The lookup and NAT kernels
+ * of the variant's ISA are passed as constants and inlined. Nodes with an
+ * empty vector are skipped.
+ */
+static inline __attribute__((always_inline)) void
+l3fwd_forward_burst(struct rte_mbuf **pkts, int nb_rx, uint8_t portid,
+	struct lcore_conf *qconf, fwd_lookup_t ipv4_lookup, fwd_nat_t ipv6_nat,
+	fwd_lookup_t ipv6_lookup, const unsigned flags)
+{
+	struct classified_burst cb;
+	struct rte_mbuf **ipv4_pkts, **ipv6_pkts, **other_pkts;
+	uint16_t *ipv4_port, *ipv6_port, *other_port;
+	uint64_t tsc;
+	int nb_route;
+
+	tsc = fwd_node_start();
+	classify_burst(pkts, nb_rx, portid, &cb);
+	tsc = fwd_node_done(qconf, FWD_NODE_PARSE, nb_rx, tsc);
+
+	if (flags & FWD_F_RFC1812) {
+		nb_route = nb_rx;
+		nb_rx = drop_invalid_classified(&cb, qconf, flags);
+		tsc = fwd_node_done(qconf, FWD_NODE_VALIDATE, nb_route, tsc);
+	}
+
+	ipv4_pkts = cb.pkts;
+	ipv4_port = cb.dst_port;
+	ipv6_pkts = ipv4_pkts + cb.nb_ipv4;
+	ipv6_port = ipv4_port + cb.nb_ipv4;
+	other_pkts = ipv6_pkts + cb.nb_ipv6;
+	other_port = ipv6_port + cb.nb_ipv6;
+
+	/*
+	 * get the first headers of every class on their way before any
+	 * lookup; the keys and L4 headers of IPv6 packets reach into the
+	 * second line
+	 */
+	if (flags & FWD_F_IPV4)
+		prefetch_pkt_hdrs(ipv4_pkts, 0, MULTI_PREFETCH_AHEAD, cb.nb_ipv4, 1);
+	if (flags & FWD_F_IPV6)
+		prefetch_pkt_hdrs(ipv6_pkts, 0, MULTI_PREFETCH_AHEAD, cb.nb_ipv6, 2);
+
+	if (!(flags & FWD_F_IPV4))
+		drop_pkts(ipv4_pkts, cb.nb_ipv4, qconf, ipv4_port);
+	else if (cb.nb_ipv4 != 0) {
+		ipv4_lookup(ipv4_pkts, cb.nb_ipv4, qconf, ipv4_port);
+		tsc = fwd_node_done(qconf, FWD_NODE_IPV4_LOOKUP, cb.nb_ipv4,
+			tsc);
+	}
+
+	if (!(flags & FWD_F_IPV6))
+		drop_pkts(ipv6_pkts, cb.nb_ipv6, qconf, ipv6_port);
+	else if (cb.nb_ipv6 != 0) {
+		nb_route = cb.nb_ipv6;
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+		if (flags & FWD_F_NAT) {
+			int32_t nat_rule[MAX_PKT_BURST];
+
+			ipv6_nat(ipv6_pkts, cb.nb_ipv6, qconf, nat_rule);
+			nb_route = ipv6_nat_apply(ipv6_pkts, cb.nb_ipv6,
+				nat_rule, ipv6_port);
+			tsc = fwd_node_done(qconf, FWD_NODE_IPV6_NAT,
+				cb.nb_ipv6, tsc);
+		}
+#else
+		RTE_SET_USED(ipv6_nat);
+#endif
+		if (nb_route != 0) {
+			ipv6_lookup(ipv6_pkts, nb_route, qconf, ipv6_port);
+			tsc = fwd_node_done(qconf, FWD_NODE_IPV6_LOOKUP,
+				nb_route, tsc);
+		}
+	}
+
+	nb_route = 0;
+	if ((flags & FWD_F_IPV4) && cb.nb_ipv4 != 0) {
+		rewrite_pkts(ipv4_pkts, cb.nb_ipv4, ipv4_port, 0, flags);
+		nb_route += cb.nb_ipv4;
+	}
+	if ((flags & FWD_F_IPV6) && cb.nb_ipv6 != 0) {
+		rewrite_pkts(ipv6_pkts, cb.nb_ipv6, ipv6_port, 1, flags);
+		nb_route += cb.nb_ipv6;
+	}
+	if (nb_route != 0)
+		tsc = fwd_node_done(qconf, FWD_NODE_REWRITE, nb_route, tsc);
+
+	if (cb.nb_other != 0) {
+		drop_other_pkts(other_pkts, cb.nb_other, qconf, other_port);
+		tsc = fwd_node_done(qconf, FWD_NODE_OTHER, cb.nb_other, tsc);
+	}
+
+	if (unlikely(tx_mseg))
+		send_mseg_pkts(qconf, cb.pkts, cb.dst_port, nb_rx);
+	send_packets_multi(qconf, cb.pkts, cb.dst_port, nb_rx);
+	fwd_node_done(qconf, FWD_NODE_TX, nb_rx, tsc);
+}
+
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+#define FWD_NAT_KERNEL(isa) ipv6_nat_##isa
+#else
+#define FWD_NAT_KERNEL(isa) NULL
+#endif
+
+#define FWD_BURST(isa, f) l3fwd_forward_burst(pkts, nb_rx, portid, qconf, \
+	ipv4_lookup_##isa, FWD_NAT_KERNEL(isa), ipv6_lookup_##isa, f)
+
+/*
+ * The forwarding variants: one function per ISA and combination of FWD_F_
+ * flags, in which the flags are constants so that disabled features cost
+ * nothing, named l3fwd_burst_<isa>_<flags>.
+ */
+#define FWD_VARIANT(isa, attr, f)					\
+static attr void							\
+l3fwd_burst_##isa##_##f(struct rte_mbuf **pkts, int nb_rx,		\
+	uint8_t portid, struct lcore_conf *qconf)			\
+{									\
+	FWD_BURST(isa, f);						\
+}
+
+/* Every combination of FWD_F_ flags that forwards at least one IP version */
+#define FWD_VARIANTS(isa, attr)						\
+	FWD_VARIANT(isa, attr, 1)  FWD_VARIANT(isa, attr, 2)		\
+	FWD_VARIANT(isa, attr, 3)  FWD_VARIANT(isa, attr, 5)		\
+	FWD_VARIANT(isa, attr, 6)  FWD_VARIANT(isa, attr, 7)		\
+	FWD_VARIANT(isa, attr, 9)  FWD_VARIANT(isa, attr, 10)		\
+	FWD_VARIANT(isa, attr, 11) FWD_VARIANT(isa, attr, 13)		\
+	FWD_VARIANT(isa, attr, 14) FWD_VARIANT(isa, attr, 15)
+
+#define FWD_VARIANT_TABLE(isa) {					\
+	[1] = l3fwd_burst_##isa##_1,   [2] = l3fwd_burst_##isa##_2,	\
+	[3] = l3fwd_burst_##isa##_3,   [5] = l3fwd_burst_##isa##_5,	\
+	[6] = l3fwd_burst_##isa##_6,   [7] = l3fwd_burst_##isa##_7,	\
+	[9] = l3fwd_burst_##isa##_9,   [10] = l3fwd_burst_##isa##_10,	\
+	[11] = l3fwd_burst_##isa##_11, [13] = l3fwd_burst_##isa##_13,	\
+	[14] = l3fwd_burst_##isa##_14, [15] = l3fwd_burst_##isa##_15,	\
+}
+
+FWD_VARIANTS(scalar, )
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH) & (ENABLE_MULTI_BUFFER_OPTIMIZE == 1)
+FWD_VARIANTS(sse, )
+#ifdef L3FWD_AVX2_KERNELS
+FWD_VARIANTS(avx2, __l3fwd_avx2)
+#endif
+#endif
+
+enum fwd_isa {
+	FWD_ISA_SCALAR = 0,
+	FWD_ISA_SSE,
+	FWD_ISA_AVX2,
+	FWD_ISA_MAX
+};
+
+/*
+ * The scalar kernels handle one packet at a time but are not a baseline
+ * x86-64 fallback: like the rest of the application they hash with the
+ * SSE4.2 CRC instruction and rewrite the headers with SSE, so SSE4.2 is
+ * the floor of every set.
+ */
+static const struct {
+	const char *name;
+	int cpu_flag; /**< CPU flag the kernels need */
+} fwd_isa_info[FWD_ISA_MAX] = {
+	[FWD_ISA_SCALAR] = {"scalar", RTE_CPUFLAG_SSE4_2},
+	[FWD_ISA_SSE] = {"sse4.2", RTE_CPUFLAG_SSE4_2},
+	[FWD_ISA_AVX2] = {"avx2", RTE_CPUFLAG_AVX2},
+};
+
+/* Variants built in, NULL where an ISA is not available in this build */
+static const fwd_burst_t fwd_variants[FWD_ISA_MAX][FWD_F_MAX] = {
+	[FWD_ISA_SCALAR] = FWD_VARIANT_TABLE(scalar),
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH) & (ENABLE_MULTI_BUFFER_OPTIMIZE == 1)
+	[FWD_ISA_SSE] = FWD_VARIANT_TABLE(sse),
+#ifdef L3FWD_AVX2_KERNELS
+	[FWD_ISA_AVX2] = FWD_VARIANT_TABLE(avx2),
+#endif
+#endif
+};
+
+static int fwd_isa_req = -1; /**< ISA given with --fwd-kernel, -1 to detect */
+
+static int
+parse_fwd_kernel(const char *name)
+{
+	int i;
+
+	for (i = 0; i < FWD_ISA_MAX; i++)
+		if (strcmp(name, fwd_isa_info[i].name) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * The YMM registers are usable only if the OS saves them on context
+ * switches: XCR0 must have its SSE and AVX state bits set.
+ */
+static int
+os_saves_ymm(void)
+{
+	uint32_t eax, edx;
+
+	if (rte_cpu_get_flag_enabled(RTE_CPUFLAG_OSXSAVE) <= 0)
+		return 0;
+	asm volatile("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return (eax & 0x6) == 0x6;
+}
+
+static int
+fwd_isa_supported(int isa)
+{
+	if (rte_cpu_get_flag_enabled(
+			(enum rte_cpu_flag_t)fwd_isa_info[isa].cpu_flag) <= 0)
+		return 0;
+	return isa != FWD_ISA_AVX2 || os_saves_ymm();
+}
+
+/*
+ * Symmetric RSS, set with --symmetric-rss. With a Toeplitz key repeating
+ * every 16 bits, swapping the source and destination addresses and ports
+ * leaves the hash unchanged, so both directions of a session go to the
+ * same RX queue. The hash of each input byte then depends on its value and
+ * on the parity of its offset only, sym_rss_table[] holds it.
+ */
+#define RSS_KEY_LEN 40
+
+static int symmetric_rss = 0;
+static uint8_t symmetric_rss_key[RSS_KEY_LEN];
+static uint32_t sym_rss_table[2][256];
+
+/* Toeplitz hash of len bytes, len + 4 at most RSS_KEY_LEN */
+static uint32_t
+toeplitz_hash(const uint8_t *key, const uint8_t *data, unsigned len)
+{
+	uint32_t hash = 0, v;
+	unsigned i, b;
+
+	v = (uint32_t)key[0] << 24 | key[1] << 16 | key[2] << 8 | key[3];
+	for (i = 0; i < len; i++) {
+		for (b = 0; b < 8; b++) {
+			if (data[i] & (0x80 >> b))
+				hash ^= v;
+			v <<= 1;
+			if (key[i + 4] & (0x80 >> b))
+				v |= 1;
+		}
+	}
+	return hash;
+}
+
+/* Toeplitz hash with symmetric_rss_key, one table lookup per byte */
+static inline uint32_t
+sym_rss_hash(const uint8_t *data, unsigned len)
+{
+	uint32_t hash = 0;
+	unsigned i;
+
+	for (i = 0; i < len; i++)
+		hash ^= sym_rss_table[i & 1][data[i]];
+	return hash;
+}
+
+/*
+ * Fill the symmetric key and its table, and check on random sessions that
+ * both directions hash alike and that the table matches the bitwise hash.
+ */
+static void
+init_symmetric_rss(void)
+{
+	uint8_t fwd[36], rev[36], byte[2];
+	unsigned i, n, len;
+
+	for (i = 0; i < RSS_KEY_LEN; i += 2) {
+		symmetric_rss_key[i] = 0x6d;
+		symmetric_rss_key[i + 1] = 0x5a;
+	}
+	for (i = 0; i < 256; i++) {
+		byte[0] = (uint8_t)i;
+		byte[1] = 0;
+		sym_rss_table[0][i] = toeplitz_hash(symmetric_rss_key, byte, 1);
+		sym_rss_table[1][i] = toeplitz_hash(symmetric_rss_key + 1, byte, 1);
+	}
+
+	/* addresses then ports, for IPv4 (12 bytes) and IPv6 (36 bytes) */
+	for (n = 0; n < 64; n++) {
+		len = (n & 1) ? 36 : 12;
+		for (i = 0; i < len; i++)
+			fwd[i] = (uint8_t)rte_rand();
+		memcpy(rev, fwd + (len - 4) / 2, (len - 4) / 2);
+		memcpy(rev + (len - 4) / 2, fwd, (len - 4) / 2);
+		memcpy(rev + len - 4, fwd + len - 2, 2);
+		memcpy(rev + len - 2, fwd + len - 4, 2);
+		if (sym_rss_hash(fwd, len) != sym_rss_hash(rev, len) ||
+				sym_rss_hash(fwd, len) !=
+				toeplitz_hash(symmetric_rss_key, fwd, len))
+			rte_exit(EXIT_FAILURE, "symmetric RSS self-check failed\n");
+	}
+}
+
+/*
+ * Hash a packet as the NIC does with the symmetric key and the fields of
+ * --rss-fields ip,tcp,udp: addresses, then the ports of TCP and UDP.
+ */
+static inline uint32_t
+sym_flow_hash(struct ether_hdr *eth_hdr, uint32_t rss)
+{
+	uint8_t data[36];
+	struct ipv4_hdr *ipv4_hdr;
+	struct ipv6_hdr *ipv6_hdr;
+	uint8_t *l4;
+	unsigned len;
+	uint8_t proto;
+
+	if (eth_hdr->ether_type == rte_cpu_to_be_16(IPV4_PKT_TYPE)) {
+		ipv4_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+		rte_memcpy(data, &ipv4_hdr->src_addr, 8);
+		len = 8;
+		proto = ipv4_hdr->next_proto_id;
+		l4 = (uint8_t *)ipv4_hdr +
+			(ipv4_hdr->version_ihl & 0xf) * IPV4_IHL_MULTIPLIER;
+	} else if (eth_hdr->ether_type == rte_cpu_to_be_16(IPV6_PKT_TYPE)) {
+		ipv6_hdr = (struct ipv6_hdr *)(eth_hdr + 1);
+		rte_memcpy(data, ipv6_hdr->src_addr, 32);
+		len = 32;
+		proto = ipv6_hdr->proto;
+		l4 = (uint8_t *)(ipv6_hdr + 1);
+	} else
+		return rss;
+
+	if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+		rte_memcpy(data + len, l4, 4);
+		len += 4;
+	}
+	return sym_rss_hash(data, len);
+}
+
+/*
+ * Hash the 5-tuple of a packet the way the exact match tables do, or as
+ * symmetric RSS does, for ports whose PMD has a single RX queue and no RSS
+ * hash to go by. Packets that are not IP keep the hash the PMD gave them.
+ */
+static inline uint32_t
+flow_hash(struct rte_mbuf *m)
+{
+	union ipv4_5tuple_host key4;
+	union ipv6_5tuple_host key6;
+	struct ether_hdr *eth_hdr;
+	uint8_t *l3;
+
+	eth_hdr = rte_pktmbuf_mtod(m, struct ether_hdr *);
+	if (symmetric_rss)
+		return sym_flow_hash(eth_hdr, m->pkt.hash.rss);
+	l3 = (uint8_t *)(eth_hdr + 1);
+
+	if (eth_hdr->ether_type == rte_cpu_to_be_16(IPV4_PKT_TYPE)) {
+		l3 += offsetof(struct ipv4_hdr, time_to_live);
+		key4.xmm = _mm_and_si128(_mm_loadu_si128((__m128i *)l3),
+			_mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS,
+				BIT_8_TO_15));
+		return ipv4_hash_crc(&key4, sizeof(key4), 0);
+	}
+	if (eth_hdr->ether_type == rte_cpu_to_be_16(IPV6_PKT_TYPE)) {
+		l3 += offsetof(struct ipv6_hdr, payload_len);
+		key6.xmm[0] = _mm_and_si128(_mm_loadu_si128((__m128i *)l3),
+			_mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS,
+				BIT_16_TO_23));
+		key6.xmm[1] = _mm_loadu_si128((__m128i *)(l3 + sizeof(__m128i)));
+		key6.xmm[2] = _mm_and_si128(
+			_mm_loadu_si128((__m128i *)(l3 + 2 * sizeof(__m128i))),
+			_mm_set_epi32(0, 0, ALL_32_BITS, ALL_32_BITS));
+		return ipv6_hash_crc(&key6, sizeof(key6), 0);
+	}
+	return m->pkt.hash.rss;
+}
+
+/*
+ * Pipeline RX lcores: spread a burst over the worker rings by the RSS hash
+ * of each packet, or with --sw-distribute by flow_hash(), so that a flow
+ * always goes to the same worker and stays in order. The packets are
+ * grouped per worker and enqueued in bulk, those a full ring refuses are
+ * dropped.
+ */
+static void
+pipeline_dispatch(struct rte_mbuf **pkts, int nb_rx, uint8_t portid,
+	struct lcore_conf *qconf)
+{
+	struct rte_mbuf *sorted[MAX_PKT_BURST];
+	uint32_t hash[MAX_PKT_BURST];
+	uint8_t worker[MAX_PKT_BURST];
+	uint16_t pos[MAX_PIPELINE_LCORES + 1];
+	unsigned n, sent;
+	int i, w;
+
+	if (sw_distribute) {
+		for (i = 0; i < nb_rx; i++)
+			rte_prefetch0(rte_pktmbuf_mtod(pkts[i], void *));
+		for (i = 0; i < nb_rx; i++)
+			hash[i] = flow_hash(pkts[i]);
+	} else {
+		for (i = 0; i < nb_rx; i++)
+			hash[i] = pkts[i]->pkt.hash.rss;
+	}
+
+	memset(pos, 0, sizeof(pos));
+	for (i = 0; i < nb_rx; i++) {
+		if (portid != RX_PORT_MIXED)
+			pkts[i]->pkt.in_port = portid;
+		/* map the 32 bit hash onto [0, nb_worker_lcores) */
+		worker[i] = (uint8_t)(((uint64_t)hash[i] * nb_worker_lcores) >> 32);
+		pos[worker[i] + 1]++;
+	}
+
+	/* turn the counts into the start of each worker's run */
+	for (w = 1; w < nb_worker_lcores; w++)
+		pos[w + 1] += pos[w];
+	for (i = 0; i < nb_rx; i++)
+		sorted[pos[worker[i]]++] = pkts[i];
+
+	/* pos[w] is now the end of the run of worker w */
+	for (w = 0, i = 0; w < nb_worker_lcores; i = pos[w++]) {
+		n = pos[w] - i;
+		if (n == 0)
+			continue;
+		sent = rte_ring_mp_enqueue_burst(worker_ring[w],
+			(void **)&sorted[i], n);
+		qconf->dispatched[w] += sent;
+		if (unlikely(sent < n)) {
+			free_pkts_bulk(&sorted[i + sent], (uint16_t)(n - sent));
+			qconf->ring_dropped += n - sent;
+		}
+	}
+}
+
+/*
+ * Pipeline RX lcores with --reorder: number the packets of a burst and
+ * give it whole to the worker with the most room in its ring. No more
+ * numbers than REORDER_WINDOW are in flight, so that a fast worker cannot
+ * push the window past the packets of a slow one: what does not fit is
+ * dropped before it gets a number. So are the packets a full ring
+ * refuses, so that the reorder stage does not wait for them.
+ */
+static void
+pipeline_spread(struct rte_mbuf **pkts, int nb_rx, uint8_t portid,
+	struct lcore_conf *qconf)
+{
+	struct reorder_buffer *rb = qconf->reorder;
+	unsigned w, best, room, best_room, sent;
+	uint32_t rx;
+	int i;
+
+	room = REORDER_WINDOW - ((qconf->seq - rb->next_seq) & SEQ_MASK);
+	if (unlikely(room < (unsigned)nb_rx)) {
+		free_pkts_bulk(&pkts[room], (uint16_t)(nb_rx - room));
+		rb->window_full += nb_rx - room;
+		nb_rx = (int)room;
+		if (nb_rx == 0)
+			return;
+	}
+
+	rx = (uint32_t)qconf->rx_index << SEQ_BITS;
+	for (i = 0; i < nb_rx; i++) {
+		if (portid != RX_PORT_MIXED)
+			pkts[i]->pkt.in_port = portid;
+		pkts[i]->pkt.hash.rss = rx | (qconf->seq++ & SEQ_MASK);
+	}
+
+	best = 0;
+	best_room = 0;
+	for (w = 0; w < nb_worker_lcores; w++) {
+		room = rte_ring_free_count(worker_ring[w]);
+		if (room > best_room) {
+			best = w;
+			best_room = room;
+		}
+	}
+
+	sent = rte_ring_mp_enqueue_burst(worker_ring[best], (void **)pkts, nb_rx);
+	qconf->dispatched[best] += sent;
+	if (unlikely(sent < (unsigned)nb_rx)) {
+		qconf->seq -= nb_rx - sent;
+		free_pkts_bulk(&pkts[sent], (uint16_t)(nb_rx - sent));
+		qconf->ring_dropped += nb_rx - sent;
+	}
+}
+
+/*
+ * Give every forwarding lcore the variant built for the flags in effect,
+ * with the kernels given with --fwd-kernel or the widest this CPU runs.
+ */
+static void
+select_fwd_variants(void)
+{
+	struct lcore_conf *qconf;
+	unsigned lcore_id;
+	int isa;
+
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_LPM)
+	fwd_flags &= ~FWD_F_NAT;
+#endif
+
+	if (fwd_isa_req >= 0) {
+		isa = fwd_isa_req;
+		if (fwd_variants[isa][fwd_flags] == NULL)
+			rte_exit(EXIT_FAILURE, "%s forwarding kernels are not "
+				"built in\n", fwd_isa_info[isa].name);
+		if (!fwd_isa_supported(isa))
+			rte_exit(EXIT_FAILURE, "CPU cannot run the %s forwarding "
+				"kernels\n", fwd_isa_info[isa].name);
+	} else {
+		for (isa = FWD_ISA_MAX - 1; isa > FWD_ISA_SCALAR; isa--)
+			if (fwd_variants[isa][fwd_flags] != NULL &&
+					fwd_isa_supported(isa))
+				break;
+		if (!fwd_isa_supported(isa))
+			rte_exit(EXIT_FAILURE, "CPU cannot run the %s forwarding "
+				"kernels\n", fwd_isa_info[isa].name);
+	}
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (qconf->role == LCORE_ROLE_RX) {
+			qconf->fwd_burst = reorder ? pipeline_spread : pipeline_dispatch;
+			RTE_LOG(INFO, L3FWD, "lcore %u: rx, %hu workers\n",
+				lcore_id, nb_worker_lcores);
+			continue;
+		}
+		if (qconf->n_rx_queue == 0 && qconf->role != LCORE_ROLE_WORKER)
+			continue;
+		qconf->fwd_burst = fwd_variants[isa][fwd_flags];
+		RTE_LOG(INFO, L3FWD, "lcore %u: %s kernels, %s%s%s, burst %hu\n",
+			lcore_id, fwd_isa_info[isa].name,
+			(fwd_flags & FWD_F_IPV4) ?
+				((fwd_flags & FWD_F_IPV6) ? "ipv4+ipv6" : "ipv4") : "ipv6",
+			(fwd_flags & FWD_F_NAT) ? ", nat" : "",
+			(fwd_flags & FWD_F_RFC1812) ? ", rfc1812" : "",
+			rx_burst_size);
+	}
+}
+
+/*
+ * Statistics are dumped on SIGUSR1. The handler only raises a flag; an
+ * EAL alarm polls it every STATS_POLL_MS and prints the report from the
+ * interrupt thread, outside of signal context and of the forwarding
+ * lcores, whose RX queues would fill up for the length of the dump.
+ */
+#define STATS_POLL_MS 100
+
+static volatile uint32_t stats_dump_requested = 0;
+
+static void
+print_node_stats(void)
+{
+	const struct fwd_node_stats *ns;
+	unsigned lcore_id;
+	int node;
+
+	printf("\n====== Forwarding graph statistics ======\n");
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		for (node = 0; node < FWD_NODE_MAX; node++) {
+			ns = &lcore_conf[lcore_id].node_stats[node];
+			if (ns->calls == 0)
+				continue;
+			printf("lcore %u %-12s vectors %"PRIu64" packets %"PRIu64
+				" (%.1f/vector)", lcore_id, fwd_node_name[node],
+				ns->calls, ns->pkts, (double)ns->pkts / ns->calls);
+			if (ns->cycles != 0 && ns->pkts != 0)
+				printf(" cycles/packet %.1f",
+					(double)ns->cycles / ns->pkts);
+			printf("\n");
+		}
+		if (lcore_conf[lcore_id].non_ip_dropped != 0)
+			printf("lcore %u dropped %"PRIu64" non-IP packets\n",
+				lcore_id, lcore_conf[lcore_id].non_ip_dropped);
+	}
+	printf("=========================================\n");
+}
+
+static void
+print_tx_stats(void)
+{
+	const struct tx_queue_stats *st;
+	const struct lcore_conf *qconf;
+	unsigned lcore_id;
+	uint16_t i;
+	uint8_t portid;
+
+	printf("\n====== TX queue statistics (%s policy) ======\n",
+		tx_policy_name[tx_policy]);
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		for (i = 0; i < qconf->n_tx_port; i++) {
+			portid = qconf->tx_port_id[i];
+			st = &qconf->tx_stats[portid];
+			if (st->sent == 0 && st->dropped == 0)
+				continue;
+			if (qconf->tx_queue_id[portid] == TX_QUEUE_SHARED)
+				printf("lcore %u port %hhu txq shared", lcore_id,
+					portid);
+			else
+				printf("lcore %u port %hhu txq %hu", lcore_id, portid,
+					qconf->tx_queue_id[portid]);
+			printf(" sent %"PRIu64" queue full %"PRIu64" retries %"PRIu64
+				" dropped %"PRIu64"\n", st->sent, st->full,
+				st->retries, st->dropped);
+		}
+	}
+	printf("==============================================\n");
+}
+
+static void
+print_pipeline_stats(void)
+{
+	const struct lcore_conf *qconf;
+	unsigned lcore_id;
+	uint16_t i;
+	uint8_t portid;
+
+	if (nb_worker_lcores == 0)
+		return;
+
+	printf("\n====== Pipeline statistics ======\n");
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (qconf->role == LCORE_ROLE_RX) {
+			printf("rx lcore %u worker ring full drops %"PRIu64
+				", queued per worker:", lcore_id, qconf->ring_dropped);
+			for (i = 0; i < nb_worker_lcores; i++)
+				printf(" %"PRIu64, qconf->dispatched[i]);
+			printf("\n");
+			if (qconf->reorder != NULL)
+				printf("rx lcore %u reorder buffered %u skipped %"PRIu64
+					" late %"PRIu64" dropped %"PRIu64" window full %"PRIu64
+					"\n", lcore_id,
+					qconf->reorder->count, qconf->reorder->skipped,
+					qconf->reorder->late, qconf->reorder->dropped,
+					qconf->reorder->window_full);
+		} else if (qconf->role == LCORE_ROLE_WORKER)
+			printf("worker lcore %u ring %u queued\n", lcore_id,
+				rte_ring_count(qconf->rx_ring));
+		else if (qconf->role == LCORE_ROLE_TX) {
+			for (i = 0; i < qconf->n_ring_port; i++) {
+				portid = qconf->ring_port_id[i];
+				printf("tx lcore %u port %hhu ring %u queued\n",
+					lcore_id, portid,
+					rte_ring_count(port_tx_ring[portid]));
+			}
+		}
+	}
+	printf("=================================\n");
+}
+
+static void
+print_rebalance_stats(void)
+{
+	const struct lcore_conf *qconf;
+	unsigned lcore_id;
+	uint16_t i;
+
+	if (rebalance_lcore < 0)
+		return;
+
+	printf("\n====== RX queue rebalancing (%"PRIu64" moves) ======\n",
+		rebalance_moves);
+	if (reta_rebalance)
+		printf("RETA bucket moves %"PRIu64" drain timeouts %"PRIu64"\n",
+			reta_moves, reta_drain_timeouts);
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (!qconf->rebalanced)
+			continue;
+		printf("lcore %u load %hu/1000 queues:", lcore_id,
+			lcore_load[lcore_id]);
+		for (i = 0; i < qconf->n_rx_queue; i++)
+			printf(" %hhu/%hhu", qconf->rx_queue_list[i].port_id,
+				qconf->rx_queue_list[i].queue_id);
+		printf("\n");
+	}
+	printf("=================================================\n");
+}
+
+static void
+print_idle_stats(void)
+{
+	const struct lcore_conf *qconf;
+	unsigned lcore_id;
+	uint64_t total;
+
+	if (!idle_backoff)
+		return;
+
+	printf("\n====== Idle backoff ======\n");
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		total = qconf->busy_tsc + qconf->idle_tsc;
+		if (total == 0)
+			continue;
+		printf("lcore %u paused %"PRIu64"/1000 of the time in %"PRIu64
+			" pauses, %"PRIu64" wakeups delayed by %"PRIu64" us on"
+			" average, %u us at most", lcore_id,
+			qconf->pause_tsc * 1000 / total, qconf->pauses,
+			qconf->wakeups, qconf->wakeups == 0 ? 0 :
+			qconf->wake_us / qconf->wakeups, qconf->wake_max_us);
+		if (qconf->cpufreq)
+			printf(", %"PRIu64" frequency changes%s", qconf->freq_changes,
+				qconf->freq_low ? ", now at the lowest" : "");
+		printf("\n");
+	}
+	printf("==========================\n");
+}
+
+static void
+print_stats(void)
+{
+	print_node_stats();
+	print_tx_stats();
+	print_pipeline_stats();
+	print_rebalance_stats();
+	print_idle_stats();
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+	print_em_stats();
+#endif
+}
+
+static void
+signal_handler(int signum)
+{
+	if (signum == SIGUSR1)
+		stats_dump_requested = 1;
+}
+
+static void
+stats_alarm(__attribute__((unused)) void *arg)
+{
+	if (unlikely(stats_dump_requested) &&
+			rte_atomic32_cmpset(&stats_dump_requested, 1, 0))
+		print_stats();
+	if (rte_eal_alarm_set(STATS_POLL_MS * 1000, stats_alarm, NULL) < 0)
+		printf("Cannot poll for statistics requests any more\n");
+}
+
+/* Send what is buffered for the TX ports of this lcore */
+static inline void
+flush_tx_ports(struct lcore_conf *qconf)
+{
+	uint16_t i;
+	uint8_t portid;
+
+	for (i = 0; i < qconf->n_tx_port; i++) {
+		portid = qconf->tx_port_id[i];
+		if (qconf->tx_mbufs[portid].len == 0)
+			continue;
+		send_burst(qconf, qconf->tx_mbufs[portid].len, portid);
+	}
+}
+
+/*
+ * Idle backoff: pause after a round of polls that brought no packet, once
+ * there were IDLE_SPIN_ROUNDS of them in a row, see idle_backoff. A packet
+ * that arrives during a pause waits for its end, so a wakeup is accounted
+ * with the pause it ended as the delay of the first packets.
+ */
+static inline void
+lcore_idle(struct lcore_conf *qconf, uint32_t nb_rx_round)
+{
+	uint64_t start_tsc, end_tsc;
+	uint16_t i;
+
+	if (likely(nb_rx_round != 0)) {
+		if (unlikely(qconf->pause_us != 0)) {
+			qconf->wakeups++;
+			qconf->wake_us += qconf->pause_us;
+			if (qconf->pause_us > qconf->wake_max_us)
+				qconf->wake_max_us = qconf->pause_us;
+			qconf->pause_us = 0;
+			if (qconf->freq_low) {
+				rte_power_freq_max(rte_lcore_id());
+				qconf->freq_low = 0;
+				qconf->freq_changes++;
+			}
+		}
+		qconf->empty_rounds = 0;
+		return;
+	}
+
+	if (qconf->empty_rounds < IDLE_SPIN_ROUNDS) {
+		qconf->empty_rounds++;
+		return;
+	}
+
+	/* a RETA update waits for the lcore to poll one of its queues empty */
+	for (i = 0; i < qconf->n_rx_queue; i++)
+		if (unlikely(qconf->rx_queue_list[i].drain_req))
+			return;
+
+	if (qconf->pause_us == 0) {
+		/* nothing is to wait in the TX buffers while the lcore pauses */
+		flush_tx_ports(qconf);
+		qconf->pause_us = 1;
+	} else
+		qconf->pause_us = RTE_MIN(qconf->pause_us * 2, idle_max_us);
+
+	if (qconf->cpufreq && !qconf->freq_low &&
+			qconf->pause_us == idle_max_us) {
+		rte_power_freq_min(rte_lcore_id());
+		qconf->freq_low = 1;
+		qconf->freq_changes++;
+	}
+
+	start_tsc = rte_rdtsc();
+	if (qconf->pause_us < IDLE_SLEEP_US) {
+		end_tsc = start_tsc + rte_get_tsc_hz() / US_PER_S * qconf->pause_us;
+		while (rte_rdtsc() < end_tsc)
+			_mm_pause();
+	} else
+		usleep(qconf->pause_us);
+	qconf->pause_tsc += rte_rdtsc() - start_tsc;
+	qconf->pauses++;
+}
+
+/*
+ * Receive a burst from one of the lcore's RX queues, unless a RETA update
+ * holds it, and count it per queue and per RETA bucket.
+ */
+static inline uint16_t
+rx_poll_queue(struct lcore_conf *qconf, struct lcore_rx_queue *rxq,
+	struct rte_mbuf **pkts, uint16_t n)
+{
+	uint32_t *cnt;
+	uint16_t i, nb;
+
+	if (unlikely(rxq->hold))
+		return 0;
+	nb = rte_eth_rx_burst(rxq->port_id, rxq->queue_id, pkts, n);
+	rxq->rx_pkts += nb;
+	if (unlikely(qconf->rss_bucket_pkts != NULL)) {
+		cnt = qconf->rss_bucket_pkts +
+			rxq->port_id * ETH_RSS_RETA_NUM_ENTRIES;
+		for (i = 0; i < nb; i++)
+			cnt[pkts[i]->pkt.hash.rss & (ETH_RSS_RETA_NUM_ENTRIES - 1)]++;
+	}
+	return nb;
+}
+
+/*
+ * A queue whose RETA buckets are moving was polled empty after the update:
+ * what it received before went out, the new queue of the buckets may be
+ * polled. The pollers read drain_req before the poll, so that a poll that
+ * started before the update cannot acknowledge it.
+ */
+static inline void
+rx_queue_drained(struct lcore_conf *qconf, struct lcore_rx_queue *rxq)
+{
+	flush_tx_ports(qconf);
+	rte_wmb();
+	rxq->drain_req = 0;
+}
+
+/*
+ * Poll the RX queues of the lcore into a single burst, starting after the
+ * last queue that was read, until the burst is full or every queue has
+ * been polled once, and forward it in one go. Short bursts from many
+ * queues then still fill the batched lookups. The ingress port is kept in
+ * each mbuf for the route miss fallback.
+ */
+static inline int
+l3fwd_rx_coalesced(struct lcore_conf *qconf, struct rte_mbuf **pkts)
+{
+	struct lcore_rx_queue *rxq, *drained = NULL;
+	uint16_t i, n, q, nb;
+	uint8_t drain;
+
+	nb = 0;
+	q = qconf->rx_queue_next;
+	for (i = 0; i < qconf->n_rx_queue && nb < rx_burst_size; i++) {
+		rxq = &qconf->rx_queue_list[q];
+		drain = rxq->drain_req;
+		n = rx_poll_queue(qconf, rxq, pkts + nb,
+			(uint16_t)(rx_burst_size - nb));
+		if (unlikely(drain) && n < rx_burst_size - nb)
+			drained = rxq;
+		for (; n != 0; n--)
+			pkts[nb++]->pkt.in_port = rxq->port_id;
+		if (++q == qconf->n_rx_queue)
+			q = 0;
+	}
+	qconf->rx_queue_next = q;
+
+	if (nb != 0)
+		qconf->fwd_burst(pkts, nb, RX_PORT_MIXED, qconf);
+	if (unlikely(drained != NULL))
+		rx_queue_drained(qconf, drained);
+	return nb;
+}
+
+/* Worker: forward what the RX lcores queued for this lcore */
+static inline uint32_t
+poll_worker_ring(struct lcore_conf *qconf, struct rte_mbuf **pkts)
+{
+	unsigned nb;
+
+	nb = rte_ring_sc_dequeue_burst(qconf->rx_ring, (void **)pkts,
+		rx_burst_size);
+	if (nb != 0)
+		qconf->fwd_burst(pkts, nb, RX_PORT_MIXED, qconf);
+	return nb;
+}
+
+/*
+ * Queue a packet the reorder stage releases, sending full bursts. The
+ * packets a worker dropped are freed.
+ */
+static inline void
+reorder_emit(struct lcore_conf *qconf, struct rte_mbuf *m,
+	struct rte_mbuf **out, uint16_t *dst_port, int *nb)
+{
+	if (unlikely(m->pkt.in_port == DROPPED_PORT)) {
+		rte_pktmbuf_free(m);
+		qconf->reorder->dropped++;
+		return;
+	}
+	out[*nb] = m;
+	dst_port[*nb] = m->pkt.in_port;
+	if (++*nb == MAX_PKT_BURST) {
+		if (unlikely(tx_mseg))
+			send_mseg_pkts(qconf, out, dst_port, *nb);
+		send_packets_multi(qconf, out, dst_port, *nb);
+		*nb = 0;
+	}
+}
+
+/*
+ * RX lcore with --reorder: put the packets the workers returned in the
+ * slots of their sequence numbers and send the run of packets that is now
+ * in order. A missing packet waited for longer than --reorder-timeout-us
+ * is given up on. The workers give back the packets they drop, so that
+ * only a packet lost on the way is waited for. A packet that arrives after
+ * its number was given up on is sent as it is. pipeline_spread() keeps
+ * the numbers in flight within the window; a packet too far ahead for it
+ * would push it forward, giving up on the numbers it leaves behind.
+ */
+static inline uint32_t
+reorder_poll(struct lcore_conf *qconf, struct rte_mbuf **pkts)
+{
+	struct reorder_buffer *rb = qconf->reorder;
+	struct rte_mbuf *out[MAX_PKT_BURST], **slot;
+	uint16_t dst_port[MAX_PKT_BURST + DST_PORT_PAD];
+	uint32_t seq, d, start;
+	uint64_t now;
+	unsigned i, n;
+	int nb = 0;
+
+	n = rte_ring_sc_dequeue_burst(reorder_ring[qconf->rx_index],
+		(void **)pkts, MAX_PKT_BURST);
+	if (n == 0 && rb->count == 0)
+		return 0;
+
+	start = rb->next_seq;
+	for (i = 0; i < n; i++) {
+		seq = pkts[i]->pkt.hash.rss & SEQ_MASK;
+		d = (seq - rb->next_seq) & SEQ_MASK;
+		if (unlikely(d > SEQ_MASK / 2)) {
+			rb->late++;
+			reorder_emit(qconf, pkts[i], out, dst_port, &nb);
+			continue;
+		}
+		if (unlikely(d >= REORDER_WINDOW) && rb->count == 0) {
+			rb->skipped += d;
+			rb->next_seq = seq;
+			d = 0;
+		}
+		while (unlikely(d >= REORDER_WINDOW)) {
+			slot = &rb->slot[rb->next_seq & (REORDER_WINDOW - 1)];
+			if (*slot != NULL) {
+				reorder_emit(qconf, *slot, out, dst_port, &nb);
+				*slot = NULL;
+				rb->count--;
+			} else
+				rb->skipped++;
+			rb->next_seq = (rb->next_seq + 1) & SEQ_MASK;
+			d--;
+		}
+		rb->slot[seq & (REORDER_WINDOW - 1)] = pkts[i];
+		rb->count++;
+	}
+
+	for (;;) {
+		slot = &rb->slot[rb->next_seq & (REORDER_WINDOW - 1)];
+		while (rb->count != 0 && *slot != NULL) {
+			reorder_emit(qconf, *slot, out, dst_port, &nb);
+			*slot = NULL;
+			rb->count--;
+			rb->next_seq = (rb->next_seq + 1) & SEQ_MASK;
+			slot = &rb->slot[rb->next_seq & (REORDER_WINDOW - 1)];
+		}
+		if (rb->count == 0) {
+			rb->gap_tsc = 0;
+			break;
+		}
+		now = rte_rdtsc();
+		if (rb->next_seq != start || rb->gap_tsc == 0) {
+			rb->gap_tsc = now;
+			break;
+		}
+		if (now - rb->gap_tsc < reorder_timeout_tsc)
+			break;
+		/* give up on the missing packets up to the next one buffered */
+		while (*slot == NULL) {
+			rb->skipped++;
+			rb->next_seq = (rb->next_seq + 1) & SEQ_MASK;
+			slot = &rb->slot[rb->next_seq & (REORDER_WINDOW - 1)];
+		}
+		start = rb->next_seq;
+	}
+
+	if (nb != 0) {
+		if (unlikely(tx_mseg))
+			send_mseg_pkts(qconf, out, dst_port, nb);
+		send_packets_multi(qconf, out, dst_port, nb);
+	}
+	return n;
+}
+
+/*
+ * TX lcore, or lcore sharing its TX queues: buffer what the other lcores
+ * queued to its ports for the NIC
+ */
+static inline uint32_t
+poll_tx_rings(struct lcore_conf *qconf, struct rte_mbuf **pkts)
+{
+	uint16_t dst_port[MAX_PKT_BURST + DST_PORT_PAD];
+	uint32_t nb = 0;
+	unsigned j, n;
+	uint16_t i;
+	uint8_t portid;
+
+	for (i = 0; i < qconf->n_ring_port; i++) {
+		portid = qconf->ring_port_id[i];
+		n = rte_ring_sc_dequeue_burst(port_tx_ring[portid],
+			(void **)pkts, MAX_PKT_BURST);
+		nb += n;
+		if (n == 0)
+			continue;
+		if (likely(!tx_mseg)) {
+			send_packets_to_port(qconf, portid, pkts, (uint16_t)n);
+			continue;
+		}
+		for (j = 0; j < n; j++)
+			dst_port[j] = portid;
+		send_mseg_pkts(qconf, pkts, dst_port, n);
+		send_packets_multi(qconf, pkts, dst_port, n);
+	}
+	return nb;
+}
+
+/*
+ * Give an RX queue to another lcore, or take one, between two polls.
+ * Only the owner of a queue polls it: the giver removes the queue from its
+ * list and sends what it buffered from it before it fills the inbox of
+ * the taker, which appends the queue to its own list. The control lcore
+ * has a single handoff in flight at any time.
+ */
+static void
+rx_queue_handoff(struct lcore_conf *qconf)
+{
+	struct lcore_conf *dst;
+	uint16_t i;
+
+	if (qconf->inbox_full) {
+		rte_rmb();
+		qconf->rx_queue_list[qconf->n_rx_queue++] = qconf->inbox;
+		RTE_LOG(INFO, L3FWD, "lcore %u took port %hhu rxqueue %hhu\n",
+			rte_lcore_id(), qconf->inbox.port_id,
+			qconf->inbox.queue_id);
+		rte_wmb();
+		qconf->inbox_full = 0;
+	}
+
+	if (qconf->handoff_queue != 0) {
+		rte_rmb();
+		i = qconf->handoff_queue - 1;
+		dst = &lcore_conf[qconf->handoff_to];
+		flush_tx_ports(qconf);
+		dst->inbox = qconf->rx_queue_list[i];
+		for (qconf->n_rx_queue--; i < qconf->n_rx_queue; i++)
+			qconf->rx_queue_list[i] = qconf->rx_queue_list[i + 1];
+		if (qconf->rx_queue_next >= qconf->n_rx_queue)
+			qconf->rx_queue_next = 0;
+		rte_wmb();
+		dst->inbox_full = 1;
+		qconf->handoff_queue = 0;
+	}
+}
+
+/*
+ * Control lcore: every rebalance_ms, compute the load of each lcore taking
+ * part in the rebalancing from its busy and idle cycles, and when the
+ * busiest one is above REBALANCE_LOAD_HIGH and REBALANCE_LOAD_GAP above
+ * the least busy one, move to the latter the queue of the busiest lcore
+ * that best evens their loads out. The share of a queue in the load of its
+ * lcore is estimated from the packets it received.
+ */
+static void
+rebalance_step(void)
+{
+	static uint64_t prev_busy[RTE_MAX_LCORE], prev_idle[RTE_MAX_LCORE];
+	static uint64_t prev_pkts[RTE_MAX_LCORE][MAX_RX_QUEUE_PER_LCORE];
+	static int prev_pkts_valid = 0;
+	uint64_t busy, idle, pkts[MAX_RX_QUEUE_PER_LCORE], total;
+	struct lcore_conf *qconf;
+	unsigned lcore_id, hot, cold;
+	uint32_t share, best_share, worst, best_worst;
+	int best, in_flight;
+	uint16_t i;
+
+	hot = cold = RTE_MAX_LCORE;
+	in_flight = 0;
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (!qconf->rebalanced)
+			continue;
+		busy = qconf->busy_tsc;
+		idle = qconf->idle_tsc;
+		if (busy + idle != prev_busy[lcore_id] + prev_idle[lcore_id])
+			lcore_load[lcore_id] = (uint16_t)((busy - prev_busy[lcore_id]) *
+				1000 / (busy + idle - prev_busy[lcore_id] -
+				prev_idle[lcore_id]));
+		prev_busy[lcore_id] = busy;
+		prev_idle[lcore_id] = idle;
+		if (qconf->handoff_queue != 0 || qconf->inbox_full)
+			in_flight = 1;
+		if (qconf->n_rx_queue > 1 && (hot == RTE_MAX_LCORE ||
+				lcore_load[lcore_id] > lcore_load[hot]))
+			hot = lcore_id;
+		if (qconf->n_rx_queue < MAX_RX_QUEUE_PER_LCORE &&
+				(cold == RTE_MAX_LCORE ||
+				lcore_load[lcore_id] < lcore_load[cold]))
+			cold = lcore_id;
+	}
+
+	/* the queue lists change with a handoff, start the counts over */
+	if (in_flight) {
+		prev_pkts_valid = 0;
+		return;
+	}
+	if (!prev_pkts_valid || hot == RTE_MAX_LCORE ||
+			cold == RTE_MAX_LCORE || hot == cold || lcore_load[hot] < REBALANCE_LOAD_HIGH ||
+			lcore_load[hot] - lcore_load[cold] < REBALANCE_LOAD_GAP)
+		goto save_pkts;
+
+	/* packets of each queue of the busiest lcore over the interval */
+	qconf = &lcore_conf[hot];
+	total = 0;
+	for (i = 0; i < qconf->n_rx_queue; i++) {
+		pkts[i] = qconf->rx_queue_list[i].rx_pkts - prev_pkts[hot][i];
+		total += pkts[i];
+	}
+	if (total == 0)
+		goto save_pkts;
+
+	best = -1;
+	best_worst = lcore_load[hot];
+	best_share = 0;
+	for (i = 0; i < qconf->n_rx_queue; i++) {
+		share = (uint32_t)(pkts[i] * lcore_load[hot] / total);
+		worst = RTE_MAX(lcore_load[hot] - share, lcore_load[cold] + share);
+		if (worst < best_worst) {
+			best = i;
+			best_worst = worst;
+			best_share = share;
+		}
+	}
+	if (best < 0)
+		goto save_pkts;
+
+	RTE_LOG(INFO, L3FWD, "rebalance: port %hhu rxqueue %hhu (%u/1000) from"
+		" lcore %u (%hu/1000) to lcore %u (%hu/1000)\n",
+		qconf->rx_queue_list[best].port_id,
+		qconf->rx_queue_list[best].queue_id, best_share, hot,
+		lcore_load[hot], cold, lcore_load[cold]);
+	qconf->handoff_to = (uint8_t)cold;
+	rte_wmb();
+	qconf->handoff_queue = (uint16_t)(best + 1);
+	rebalance_moves++;
+	prev_pkts_valid = 0;
+	return;
+
+save_pkts:
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (!qconf->rebalanced)
+			continue;
+		for (i = 0; i < qconf->n_rx_queue; i++)
+			prev_pkts[lcore_id][i] = qconf->rx_queue_list[i].rx_pkts;
+	}
+	prev_pkts_valid = 1;
+}
+
+/* The RX queue entry of a port's queue, in the list of the lcore polling it */
+static struct lcore_rx_queue *
+find_rx_queue(uint8_t portid, uint8_t queueid)
+{
+	struct lcore_conf *qconf;
+	unsigned lcore_id;
+	uint16_t i;
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		for (i = 0; i < qconf->n_rx_queue; i++) {
+			if (qconf->rx_queue_list[i].port_id == portid &&
+					qconf->rx_queue_list[i].queue_id == queueid)
+				return &qconf->rx_queue_list[i];
 		}
-#endif
+	}
+	return NULL;
+}
 
-		dst_port = get_ipv4_dst_port(ipv4_hdr, portid, qconf->ipv4_lookup_struct);
-		if (dst_port >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port) == 0)
-			dst_port = portid;
+/*
+ * Point a RETA bucket of a port at another RX queue without reordering its
+ * flows: the new queue is held, the RETA is updated, and the new queue is
+ * released once the lcore polling the old one found it empty, so that
+ * what the bucket had queued there was forwarded first.
+ */
+static void
+reta_move_bucket(uint8_t portid, unsigned bucket, uint8_t from, uint8_t to)
+{
+	struct rte_eth_rss_reta reta;
+	struct lcore_rx_queue *old_rxq, *new_rxq;
+	uint64_t deadline;
+	int ret;
 
-		/* 02:00:00:00:00:xx */
-		d_addr_bytes = &eth_hdr->d_addr.addr_bytes[0];
-		*((uint64_t *)d_addr_bytes) = 0x000000000002 + ((uint64_t)dst_port << 40);
+	old_rxq = find_rx_queue(portid, from);
+	new_rxq = find_rx_queue(portid, to);
+	if (old_rxq == NULL || new_rxq == NULL)
+		return;
 
-#ifdef DO_RFC_1812_CHECKS
-		/* Update time to live and header checksum */
-		--(ipv4_hdr->time_to_live);
-		++(ipv4_hdr->hdr_checksum);
-#endif
+	memset(&reta, 0, sizeof(reta));
+	if (bucket < 64)
+		reta.mask_lo = (uint64_t)1 << bucket;
+	else
+		reta.mask_hi = (uint64_t)1 << (bucket - 64);
+	reta.reta[bucket] = to;
+
+	new_rxq->hold = 1;
+	rte_wmb();
+	ret = rte_eth_dev_rss_reta_update(portid, &reta);
+	if (ret == 0) {
+		port_reta[portid][bucket] = to;
+		reta_moves++;
+		rte_wmb();
+		old_rxq->drain_req = 1;
+		/* the lcore may be in the middle of an idle pause */
+		deadline = rte_rdtsc() + (rte_get_tsc_hz() + US_PER_S - 1) /
+			US_PER_S * (RETA_DRAIN_TIMEOUT_US +
+				(idle_backoff ? idle_max_us : 0));
+		while (old_rxq->drain_req && rte_rdtsc() < deadline)
+			;
+		if (old_rxq->drain_req) {
+			old_rxq->drain_req = 0;
+			reta_drain_timeouts++;
+		}
+	} else
+		RTE_LOG(INFO, L3FWD, "port %hhu: RETA update failed: %d\n",
+			portid, ret);
+	rte_wmb();
+	new_rxq->hold = 0;
+}
 
-		/* src addr */
-		ether_addr_copy(&ports_eth_addr[dst_port], &eth_hdr->s_addr);
+/*
+ * Control lcore with --reta-rebalance: per port, sum the packets of each
+ * RETA bucket over the interval, and when the busiest RX queue received
+ * RETA_LOAD_GAP percent more than the least busy one, move to the latter
+ * the bucket of the former that best evens them out. One bucket moves per
+ * port and interval, and none while an RX queue changes lcore.
+ */
+static void
+reta_rebalance_step(void)
+{
+	static uint64_t prev[RTE_MAX_ETHPORTS][ETH_RSS_RETA_NUM_ENTRIES];
+	uint64_t bucket_pkts[ETH_RSS_RETA_NUM_ENTRIES];
+	uint64_t queue_pkts[ETH_RSS_RETA_MAX_QUEUE], worst, best_worst, total;
+	const struct lcore_conf *qconf;
+	unsigned lcore_id, portid, b, q, hot, cold, nq;
+	int best, in_flight = 0;
 
-		send_single_packet(m, dst_port);
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (qconf->handoff_queue != 0 || qconf->inbox_full)
+			in_flight = 1;
+	}
 
-	} else {
-		/* Handle IPv6 headers.*/
-		struct ipv6_hdr *ipv6_hdr;
-		int ret = -1;  
-		ipv6_hdr = (struct ipv6_hdr *)(rte_pktmbuf_mtod(m, unsigned char *) +
-						sizeof(struct ether_hdr));
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)              
-		ret = get_ipv6_nat_rule_index(ipv6_hdr, qconf->ipv6_lookup_struct);
-#endif /* APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH */
-
-		if (ret == -1) {
-			dst_port = get_ipv6_dst_port(ipv6_hdr, portid, qconf->ipv6_lookup_struct);
-		}
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)              
-		else {
-		    	dst_port = apply_nat_and_get_port(m, ipv6_hdr, ret);
-	    }               
-#endif /* APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH */
+	for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
+		nq = port_reta_queues[portid];
+		if (nq == 0)
+			continue;
 
-		if (dst_port >= RTE_MAX_ETHPORTS || (enabled_port_mask & 1 << dst_port) == 0)
-			dst_port = portid;
+		memset(bucket_pkts, 0, sizeof(bucket_pkts));
+		for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+			qconf = &lcore_conf[lcore_id];
+			if (qconf->rss_bucket_pkts == NULL)
+				continue;
+			for (b = 0; b < ETH_RSS_RETA_NUM_ENTRIES; b++)
+				bucket_pkts[b] += qconf->rss_bucket_pkts[portid *
+					ETH_RSS_RETA_NUM_ENTRIES + b];
+		}
+		/* per bucket packets over the interval, the counters wrap */
+		for (b = 0; b < ETH_RSS_RETA_NUM_ENTRIES; b++) {
+			total = (uint32_t)(bucket_pkts[b] - prev[portid][b]);
+			prev[portid][b] = bucket_pkts[b];
+			bucket_pkts[b] = total;
+		}
+		if (in_flight)
+			continue;
 
-		/* 02:00:00:00:00:xx */
-		d_addr_bytes = &eth_hdr->d_addr.addr_bytes[0];
-		*((uint64_t *)d_addr_bytes) = 0x000000000002 + ((uint64_t)dst_port << 40);
+		memset(queue_pkts, 0, sizeof(queue_pkts));
+		for (b = 0; b < ETH_RSS_RETA_NUM_ENTRIES; b++)
+			queue_pkts[port_reta[portid][b]] += bucket_pkts[b];
+		hot = cold = 0;
+		for (q = 1; q < nq; q++) {
+			if (queue_pkts[q] > queue_pkts[hot])
+				hot = q;
+			if (queue_pkts[q] < queue_pkts[cold])
+				cold = q;
+		}
+		if (queue_pkts[hot] < RETA_MIN_PKTS || queue_pkts[hot] -
+				queue_pkts[cold] < queue_pkts[hot] * RETA_LOAD_GAP / 100)
+			continue;
 
-		/* src addr */
-		ether_addr_copy(&ports_eth_addr[dst_port], &eth_hdr->s_addr);
+		best = -1;
+		best_worst = queue_pkts[hot];
+		for (b = 0; b < ETH_RSS_RETA_NUM_ENTRIES; b++) {
+			if (port_reta[portid][b] != hot)
+				continue;
+			worst = RTE_MAX(queue_pkts[hot] - bucket_pkts[b],
+				queue_pkts[cold] + bucket_pkts[b]);
+			if (worst < best_worst) {
+				best = b;
+				best_worst = worst;
+			}
+		}
+		if (best < 0)
+			continue;
 
-		send_single_packet(m, dst_port);
+		RTE_LOG(INFO, L3FWD, "port %u: RETA bucket %d (%"PRIu64" pkts) from"
+			" rxqueue %u (%"PRIu64") to rxqueue %u (%"PRIu64")\n", portid,
+			best, bucket_pkts[best], hot, queue_pkts[hot], cold,
+			queue_pkts[cold]);
+		reta_move_bucket((uint8_t)portid, best, (uint8_t)hot, (uint8_t)cold);
 	}
+}
 
+static int
+control_loop(void)
+{
+	RTE_LOG(INFO, L3FWD, "Entering control loop on lcore %u, every %u ms\n",
+		rte_lcore_id(), rebalance_ms);
+	while (1) {
+		rte_delay_ms(rebalance_ms);
+		rebalance_step();
+		if (reta_rebalance)
+			reta_rebalance_step();
+	}
+	return 0;
 }
 
 /* main processing loop */
@@ -1178,25 +3906,29 @@ main_loop(__attribute__((unused)) void *dummy)
 {
 	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
 	unsigned lcore_id;
-	uint64_t prev_tsc, diff_tsc, cur_tsc;
-	int i, j, nb_rx;
-	uint8_t portid, queueid;
+	uint64_t prev_tsc, diff_tsc, cur_tsc, loop_tsc;
+	int i, nb_rx;
+	uint32_t nb_rx_round;
+	uint8_t portid, queueid, drain;
 	struct lcore_conf *qconf;
-	struct ether_hdr *eth_hdr[4];
-	int hdr_flag;
-	const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * BURST_TX_DRAIN_US;
+	struct lcore_rx_queue *rxq;
+	const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * tx_drain_us;
 
 	prev_tsc = 0;
 
 	lcore_id = rte_lcore_id();
 	qconf = &lcore_conf[lcore_id];
 
-	if (qconf->n_rx_queue == 0) {
+	if (qconf->role == LCORE_ROLE_CONTROL)
+		return control_loop();
+
+	if (qconf->n_rx_queue == 0 && qconf->role == LCORE_ROLE_RTC) {
 		RTE_LOG(INFO, L3FWD, "lcore %u has nothing to do\n", lcore_id);
 		return 0;
 	}
 
-	RTE_LOG(INFO, L3FWD, "Entering main loop on lcore %u\n", lcore_id);
+	RTE_LOG(INFO, L3FWD, "Entering main loop on lcore %u (%s)\n", lcore_id,
+		lcore_role_name[qconf->role]);
 
 	for (i = 0; i < qconf->n_rx_queue; i++) {
 
@@ -1206,9 +3938,20 @@ main_loop(__attribute__((unused)) void *dummy)
 			portid, queueid);
 	}
 
+	loop_tsc = rte_rdtsc();
+	nb_rx_round = 0;
+
 	while (1) {
 
 		cur_tsc = rte_rdtsc();
+		if (nb_rx_round != 0)
+			qconf->busy_tsc += cur_tsc - loop_tsc;
+		else
+			qconf->idle_tsc += cur_tsc - loop_tsc;
+		loop_tsc = cur_tsc;
+
+		if (unlikely(qconf->handoff_queue != 0 || qconf->inbox_full))
+			rx_queue_handoff(qconf);
 
 		/*
 		 * TX burst queue drain
@@ -1216,86 +3959,179 @@ main_loop(__attribute__((unused)) void *dummy)
 		diff_tsc = cur_tsc - prev_tsc;
 		if (unlikely(diff_tsc > drain_tsc)) {
 
-			/*
-			 * This could be optimized (use queueid instead of
-			 * portid), but it is not called so often
-			 */
-			for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
-				if (qconf->tx_mbufs[portid].len == 0)
-					continue;
-				send_burst(&lcore_conf[lcore_id],
-					qconf->tx_mbufs[portid].len,
-					portid);
-				qconf->tx_mbufs[portid].len = 0;
-			}
+			flush_tx_ports(qconf);
 
 			prev_tsc = cur_tsc;
 		}
 
 		/*
-		 * Read packet from RX queues
+		 * Read packet from RX queues, or from the rings of a pipeline
 		 */
-		for (i = 0; i < qconf->n_rx_queue; ++i) {
-			portid = qconf->rx_queue_list[i].port_id;
-			queueid = qconf->rx_queue_list[i].queue_id;
-			nb_rx = rte_eth_rx_burst(portid, queueid, pkts_burst, MAX_PKT_BURST);
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH) & (ENABLE_MULTI_BUFFER_OPTIMIZE == 1)
-			{
-				/* Send nb_rx - nb_rx%4 packets in groups of 4.*/
-				int32_t n = RTE_ALIGN_FLOOR(nb_rx, 4);
-				for (j = 0; j < n ; j+=4) {
-					eth_hdr[j] = rte_pktmbuf_mtod(pkts_burst[j], struct ether_hdr *);
-					eth_hdr[j+1] = rte_pktmbuf_mtod(pkts_burst[j+1], struct ether_hdr *);
-					eth_hdr[j+2] = rte_pktmbuf_mtod(pkts_burst[j+2], struct ether_hdr *);
-					eth_hdr[j+3] = rte_pktmbuf_mtod(pkts_burst[j+3], struct ether_hdr *);
-					hdr_flag = ntohs(eth_hdr[j]->ether_type
-								& eth_hdr[j+1]->ether_type
-								& eth_hdr[j+2]->ether_type
-								& eth_hdr[j+3]->ether_type);
-
-					if (hdr_flag == IPV4_PKT_TYPE ) {
-						simple_ipv4_fwd_4pkts(&pkts_burst[j], 
-									portid, qconf);
-					} else if (hdr_flag == IPV6_PKT_TYPE) {
-						simple_ipv6_fwd_4pkts(&pkts_burst[j], 
-									portid, qconf);
-					} else {
-						l3fwd_simple_forward(pkts_burst[j], 
-									portid, qconf);
-						l3fwd_simple_forward(pkts_burst[j+1], 
-									portid, qconf);
-						l3fwd_simple_forward(pkts_burst[j+2], 
-									portid, qconf);
-						l3fwd_simple_forward(pkts_burst[j+3], 
-									portid, qconf);
-					} 
-				} 
-				for (; j < nb_rx ; j++) {
-					l3fwd_simple_forward(pkts_burst[j], 
-								portid, qconf);
-				}
-			}
-#else			 
-			/* Prefetch first packets */
-			for (j = 0; j < PREFETCH_OFFSET && j < nb_rx; j++) {
-				rte_prefetch0(rte_pktmbuf_mtod(
-						pkts_burst[j], void *));
+		if (unlikely(qconf->role == LCORE_ROLE_WORKER))
+			nb_rx_round = poll_worker_ring(qconf, pkts_burst);
+		else if (unlikely(qconf->role == LCORE_ROLE_TX))
+			nb_rx_round = poll_tx_rings(qconf, pkts_burst);
+		else if (rx_coalesce)
+			nb_rx_round = l3fwd_rx_coalesced(qconf, pkts_burst);
+		else {
+			nb_rx_round = 0;
+			for (i = 0; i < qconf->n_rx_queue; ++i) {
+				rxq = &qconf->rx_queue_list[i];
+				drain = rxq->drain_req;
+				nb_rx = rx_poll_queue(qconf, rxq, pkts_burst,
+					rx_burst_size);
+				if (nb_rx != 0)
+					qconf->fwd_burst(pkts_burst, nb_rx, rxq->port_id,
+						qconf);
+				if (unlikely(drain) && nb_rx < rx_burst_size)
+					rx_queue_drained(qconf, rxq);
+				nb_rx_round += nb_rx;
 			}
+		}
+		if (qconf->reorder != NULL)
+			nb_rx_round += reorder_poll(qconf, pkts_burst);
+		if (qconf->n_ring_port != 0 && qconf->role != LCORE_ROLE_TX)
+			nb_rx_round += poll_tx_rings(qconf, pkts_burst);
 
-			/* Prefetch and forward already prefetched packets */
-			for (j = 0; j < (nb_rx - PREFETCH_OFFSET); j++) {
-				rte_prefetch0(rte_pktmbuf_mtod(pkts_burst[
-						j + PREFETCH_OFFSET], void *));
-				l3fwd_simple_forward(pkts_burst[j], portid, qconf);
-			}
+		if (nb_rx_round < tx_flush_thresh)
+			flush_tx_ports(qconf);
+
+		if (idle_backoff)
+			lcore_idle(qconf, nb_rx_round);
+	}
+}
+
+/* NUMA node of a port, -1 when the PMD does not tell */
+static int
+port_socket_id(uint8_t portid)
+{
+	struct rte_eth_dev_info dev_info;
+
+	memset(&dev_info, 0, sizeof(dev_info));
+	rte_eth_dev_info_get(portid, &dev_info);
+	if (dev_info.pci_dev == NULL || dev_info.pci_dev->numa_node < 0 ||
+			dev_info.pci_dev->numa_node >= NB_SOCKETS)
+		return -1;
+	return dev_info.pci_dev->numa_node;
+}
+
+/* Whether --auto-config may give RX queues to an lcore */
+static int
+auto_config_lcore(unsigned lcore_id)
+{
+	uint16_t i;
+
+	if (!rte_lcore_is_enabled(lcore_id) || (int)lcore_id == rebalance_lcore)
+		return 0;
+	for (i = 0; i < nb_worker_lcores; i++) {
+		if (worker_lcores[i] == lcore_id)
+			return 0;
+	}
+	for (i = 0; i < nb_tx_lcores; i++) {
+		if (tx_lcores[i] == lcore_id)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * --auto-config: build the (port,queue,lcore) table from the NUMA nodes of
+ * the ports and lcores. Each port gets as many RX queues as the lcores of
+ * its node divided among the ports of that node, one at least, and each
+ * queue goes to the lcore of the node that has the fewest yet. The ports
+ * of a node without usable lcores, and those of unknown node, are polled
+ * from any node; the former are reported.
+ */
+static void
+auto_configure(unsigned nb_ports)
+{
+	unsigned lcores_on[NB_SOCKETS], ports_on[NB_SOCKETS];
+	uint16_t nb_queues[RTE_MAX_LCORE];
+	int lcore_socket[RTE_MAX_LCORE], port_socket[RTE_MAX_ETHPORTS];
+	struct rte_eth_dev_info dev_info;
+	unsigned lcore_id, portid, nb_lcores, nb_enabled, n, nq, q, best;
+	int socketid, local;
+
+	memset(lcores_on, 0, sizeof(lcores_on));
+	memset(ports_on, 0, sizeof(ports_on));
+	memset(nb_queues, 0, sizeof(nb_queues));
+
+	nb_lcores = 0;
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		if (!auto_config_lcore(lcore_id))
+			continue;
+		/* with numa off every lcore and port counts as on socket 0 */
+		socketid = numa_on ? (int)rte_lcore_to_socket_id(lcore_id) : 0;
+		lcore_socket[lcore_id] = socketid;
+		if (socketid < NB_SOCKETS)
+			lcores_on[socketid]++;
+		nb_lcores++;
+	}
+	if (nb_lcores == 0)
+		rte_exit(EXIT_FAILURE, "--auto-config: no lcore left to poll RX"
+			" queues\n");
+
+	nb_enabled = 0;
+	for (portid = 0; portid < nb_ports; portid++) {
+		if ((enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		port_socket[portid] = numa_on ? port_socket_id(portid) : 0;
+		if (port_socket[portid] >= 0)
+			ports_on[port_socket[portid]]++;
+		nb_enabled++;
+	}
 
-			/* Forward remaining prefetched packets */
-			for (; j < nb_rx; j++) {
-				l3fwd_simple_forward(pkts_burst[j], portid, qconf);
+	nb_lcore_params = 0;
+	for (portid = 0; portid < nb_ports; portid++) {
+		if ((enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		socketid = port_socket[portid];
+		local = (socketid >= 0 && lcores_on[socketid] != 0);
+		if (local)
+			nq = (lcores_on[socketid] + ports_on[socketid] - 1) /
+				ports_on[socketid];
+		else {
+			if (socketid >= 0)
+				printf("warning: no lcore on socket %d of port %u, its"
+					" queues are polled from another socket\n",
+					socketid, portid);
+			nq = (nb_lcores + nb_enabled - 1) / nb_enabled;
+		}
+		memset(&dev_info, 0, sizeof(dev_info));
+		rte_eth_dev_info_get(portid, &dev_info);
+		if (dev_info.max_rx_queues != 0)
+			nq = RTE_MIN(nq, (unsigned)dev_info.max_rx_queues);
+		nq = RTE_MIN(nq, MAX_RX_QUEUE_PER_PORT);
+
+		for (q = 0; q < nq; q++) {
+			best = RTE_MAX_LCORE;
+			for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+				if (!auto_config_lcore(lcore_id) ||
+						nb_queues[lcore_id] >= MAX_RX_QUEUE_PER_LCORE)
+					continue;
+				if (local && lcore_socket[lcore_id] != socketid)
+					continue;
+				if (best == RTE_MAX_LCORE ||
+						nb_queues[lcore_id] < nb_queues[best])
+					best = lcore_id;
 			}
-#endif // End of #if((ENABLE_MULTI_BUFFER_OPTIMIZE == 1)&(APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH))
+			if (best == RTE_MAX_LCORE || nb_lcore_params == MAX_LCORE_PARAMS)
+				break;
+			lcore_params_array[nb_lcore_params].port_id = (uint8_t)portid;
+			lcore_params_array[nb_lcore_params].queue_id = (uint8_t)q;
+			lcore_params_array[nb_lcore_params].lcore_id = (uint8_t)best;
+			nb_lcore_params++;
+			nb_queues[best]++;
 		}
 	}
+	lcore_params = lcore_params_array;
+
+	printf("auto config: --config \"");
+	for (n = 0; n < nb_lcore_params; n++)
+		printf("%s(%hhu,%hhu,%hhu)", n == 0 ? "" : ",",
+			lcore_params[n].port_id, lcore_params[n].queue_id,
+			lcore_params[n].lcore_id);
+	printf("\"\n");
 }
 
 static int
@@ -1303,7 +4139,7 @@ check_lcore_params(void)
 {
 	uint8_t queue, lcore;
 	uint16_t i;
-	int socketid;
+	int socketid, port_socket;
 
 	for (i = 0; i < nb_lcore_params; ++i) {
 		queue = lcore_params[i].queue_id;
@@ -1321,6 +4157,13 @@ check_lcore_params(void)
 			printf("warning: lcore %hhu is on socket %d with numa off \n",
 				lcore, socketid);
 		}
+		port_socket = port_socket_id(lcore_params[i].port_id);
+		if (numa_on && port_socket >= 0 &&
+				port_socket != (int)rte_lcore_to_socket_id(lcore)) {
+			printf("warning: lcore %hhu on socket %u polls port %hhu"
+				" on socket %d\n", lcore, rte_lcore_to_socket_id(lcore),
+				lcore_params[i].port_id, port_socket);
+		}
 	}
 	return 0;
 }
@@ -1358,28 +4201,391 @@ get_port_n_rx_queues(const uint8_t port)
 	return (uint8_t)(++queue);
 }
 
-static int
-init_lcore_rx_queues(void)
+static int
+init_lcore_rx_queues(void)
+{
+	uint16_t i, nb_rx_queue;
+	uint8_t lcore;
+
+	for (i = 0; i < nb_lcore_params; ++i) {
+		lcore = lcore_params[i].lcore_id;
+		nb_rx_queue = lcore_conf[lcore].n_rx_queue;
+		if (nb_rx_queue >= MAX_RX_QUEUE_PER_LCORE) {
+			printf("error: too many queues (%u) for lcore: %u\n",
+				(unsigned)nb_rx_queue + 1, (unsigned)lcore);
+			return -1;
+		} else {
+			lcore_conf[lcore].rx_queue_list[nb_rx_queue].port_id =
+				lcore_params[i].port_id;
+			lcore_conf[lcore].rx_queue_list[nb_rx_queue].queue_id =
+				lcore_params[i].queue_id;
+			lcore_conf[lcore].n_rx_queue++;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Set the role of every lcore for pipeline mode and check the topology:
+ * a pipeline lcore has a single role and is enabled in the EAL mask.
+ */
+static int
+init_pipeline_roles(void)
+{
+	struct lcore_conf *qconf;
+	unsigned lcore_id;
+	uint16_t i;
+
+	if (nb_worker_lcores == 0) {
+		if (nb_tx_lcores != 0 || sw_distribute || reorder) {
+			printf("error: --tx-lcores, --sw-distribute and --reorder"
+				" need --worker-lcores\n");
+			return -1;
+		}
+		return 0;
+	}
+	if (sw_distribute && reorder) {
+		printf("error: --reorder spreads the packets by load,"
+			" not with --sw-distribute\n");
+		return -1;
+	}
+
+	i = 0;
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (qconf->n_rx_queue == 0)
+			continue;
+		if (reorder && i == MAX_PIPELINE_LCORES) {
+			printf("error: more than %d rx lcores with --reorder\n",
+				MAX_PIPELINE_LCORES);
+			return -1;
+		}
+		qconf->role = LCORE_ROLE_RX;
+		qconf->rx_index = (uint8_t)i++;
+		/* the RX lcores send what they reorder */
+		if (reorder && nb_tx_lcores != 0)
+			qconf->tx_to_ring = TX_TO_PORT_RING;
+	}
+
+	for (i = 0; i < nb_worker_lcores; i++) {
+		lcore_id = worker_lcores[i];
+		qconf = &lcore_conf[lcore_id];
+		if (!rte_lcore_is_enabled(lcore_id)) {
+			printf("error: worker lcore %u is not enabled in lcore mask\n",
+				lcore_id);
+			return -1;
+		}
+		if (qconf->role != LCORE_ROLE_RTC) {
+			printf("error: lcore %u is already a %s lcore\n", lcore_id,
+				lcore_role_name[qconf->role]);
+			return -1;
+		}
+		qconf->role = LCORE_ROLE_WORKER;
+		if (reorder)
+			qconf->tx_to_ring = TX_TO_REORDER;
+		else if (nb_tx_lcores != 0)
+			qconf->tx_to_ring = TX_TO_PORT_RING;
+	}
+
+	for (i = 0; i < nb_tx_lcores; i++) {
+		lcore_id = tx_lcores[i];
+		qconf = &lcore_conf[lcore_id];
+		if (!rte_lcore_is_enabled(lcore_id)) {
+			printf("error: tx lcore %u is not enabled in lcore mask\n",
+				lcore_id);
+			return -1;
+		}
+		if (qconf->role != LCORE_ROLE_RTC) {
+			printf("error: lcore %u is already a %s lcore\n", lcore_id,
+				lcore_role_name[qconf->role]);
+			return -1;
+		}
+		qconf->role = LCORE_ROLE_TX;
+	}
+	return 0;
+}
+
+/*
+ * Make the --rebalance-lcore lcore the control lcore, and let the lcores
+ * that poll RX queues take part in the rebalancing.
+ */
+static int
+init_rebalance(void)
+{
+	struct lcore_conf *qconf;
+	unsigned lcore_id;
+
+	if (rebalance_lcore < 0) {
+		if (reta_rebalance) {
+			printf("error: --reta-rebalance needs --rebalance-lcore\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	lcore_id = rebalance_lcore;
+	if (!rte_lcore_is_enabled(lcore_id)) {
+		printf("error: control lcore %u is not enabled in lcore mask\n",
+			lcore_id);
+		return -1;
+	}
+	if (lcore_conf[lcore_id].n_rx_queue != 0 ||
+			lcore_conf[lcore_id].role != LCORE_ROLE_RTC) {
+		printf("error: control lcore %u has other work\n", lcore_id);
+		return -1;
+	}
+	lcore_conf[lcore_id].role = LCORE_ROLE_CONTROL;
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (qconf->n_rx_queue == 0)
+			continue;
+		qconf->rebalanced = 1;
+		if (!reta_rebalance)
+			continue;
+		qconf->rss_bucket_pkts = rte_zmalloc_socket("rss_bucket_pkts",
+			RTE_MAX_ETHPORTS * ETH_RSS_RETA_NUM_ENTRIES * sizeof(uint32_t),
+			CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+		if (qconf->rss_bucket_pkts == NULL) {
+			printf("error: cannot allocate RETA counters for lcore %u\n",
+				lcore_id);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * --cpufreq: hand the cores of the polling lcores to the userspace cpufreq
+ * governor, which lcore_idle() sets the frequency through. An lcore whose
+ * core cannot be set up keeps its frequency.
+ */
+static int
+init_cpufreq(void)
+{
+	struct lcore_conf *qconf;
+	unsigned lcore_id;
+
+	if (!cpufreq)
+		return 0;
+	if (!idle_backoff) {
+		printf("error: --cpufreq needs --idle-backoff\n");
+		return -1;
+	}
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (!rte_lcore_is_enabled(lcore_id) ||
+				qconf->role == LCORE_ROLE_CONTROL ||
+				(qconf->n_rx_queue == 0 && qconf->role == LCORE_ROLE_RTC))
+			continue;
+		if (rte_power_init(lcore_id) < 0) {
+			printf("warning: cannot scale the frequency of lcore %u\n",
+				lcore_id);
+			continue;
+		}
+		qconf->cpufreq = 1;
+	}
+	return 0;
+}
+
+/*
+ * Read the RETA of the ports spreading over several RX queues, which
+ * --reta-rebalance then updates.
+ */
+static void
+init_reta(unsigned nb_ports)
+{
+	struct rte_eth_rss_reta reta;
+	unsigned portid, nq;
+	int ret;
+
+	for (portid = 0; portid < nb_ports && reta_rebalance; portid++) {
+		if ((enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		nq = get_port_n_rx_queues(portid);
+		if (nq < 2 || nq > ETH_RSS_RETA_MAX_QUEUE)
+			continue;
+		memset(&reta, 0, sizeof(reta));
+		reta.mask_lo = UINT64_MAX;
+		reta.mask_hi = UINT64_MAX;
+		ret = rte_eth_dev_rss_reta_query(portid, &reta);
+		if (ret != 0) {
+			printf("port %u: cannot read the RETA (%d), not rebalanced\n",
+				portid, ret);
+			continue;
+		}
+		memcpy(port_reta[portid], reta.reta, sizeof(port_reta[portid]));
+		port_reta_queues[portid] = (uint8_t)nq;
+	}
+}
+
+/*
+ * Create the rings of the pipeline: one per worker, on its socket, one
+ * per RX lcore with its reorder buffer with --reorder, and with TX lcores
+ * one per enabled port, the ports being dealt to the TX
+ * lcores in turn. The workers enqueue to the port rings from several
+ * lcores, only the owner dequeues.
+ */
+static void
+init_pipeline_rings(unsigned nb_ports)
+{
+	struct lcore_conf *qconf;
+	char name[RTE_RING_NAMESIZE];
+	unsigned lcore_id, portid, t;
+	int socketid;
+	uint16_t i;
+
+	for (i = 0; i < nb_worker_lcores; i++) {
+		lcore_id = worker_lcores[i];
+		socketid = numa_on ? (int)rte_lcore_to_socket_id(lcore_id) : 0;
+		rte_snprintf(name, sizeof(name), "worker_ring_%u", lcore_id);
+		worker_ring[i] = rte_ring_create(name, PIPELINE_RING_SIZE,
+			socketid, RING_F_SC_DEQ);
+		if (worker_ring[i] == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot create ring %s\n", name);
+		lcore_conf[lcore_id].rx_ring = worker_ring[i];
+	}
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE && reorder; lcore_id++) {
+		qconf = &lcore_conf[lcore_id];
+		if (qconf->role != LCORE_ROLE_RX)
+			continue;
+		socketid = numa_on ? (int)rte_lcore_to_socket_id(lcore_id) : 0;
+		rte_snprintf(name, sizeof(name), "reorder_ring_%u", lcore_id);
+		reorder_ring[qconf->rx_index] = rte_ring_create(name,
+			REORDER_RING_SIZE, socketid, RING_F_SC_DEQ);
+		if (reorder_ring[qconf->rx_index] == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot create ring %s\n", name);
+		qconf->reorder = rte_zmalloc_socket("reorder_buffer",
+			sizeof(struct reorder_buffer), CACHE_LINE_SIZE, socketid);
+		if (qconf->reorder == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot allocate reorder buffer for "
+				"lcore %u on socket %d\n", lcore_id, socketid);
+	}
+
+	t = 0;
+	for (portid = 0; portid < nb_ports && nb_tx_lcores != 0; portid++) {
+		if ((enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		lcore_id = tx_lcores[t];
+		qconf = &lcore_conf[lcore_id];
+		socketid = numa_on ? (int)rte_lcore_to_socket_id(lcore_id) : 0;
+		rte_snprintf(name, sizeof(name), "tx_ring_%u", portid);
+		port_tx_ring[portid] = rte_ring_create(name, PIPELINE_RING_SIZE,
+			socketid, RING_F_SC_DEQ);
+		if (port_tx_ring[portid] == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot create ring %s\n", name);
+		qconf->ring_port_id[qconf->n_ring_port++] = (uint8_t)portid;
+		printf("port %u is sent by tx lcore %u\n", portid, lcore_id);
+		t = (t + 1) % nb_tx_lcores;
+	}
+}
+
+/* Whether an lcore hands its routed packets to the NIC itself */
+static int
+lcore_sends(unsigned lcore_id)
+{
+	const struct lcore_conf *qconf = &lcore_conf[lcore_id];
+
+	if (!rte_lcore_is_enabled(lcore_id) || qconf->tx_to_ring != TX_TO_NIC)
+		return 0;
+
+	switch (qconf->role) {
+	case LCORE_ROLE_RTC:
+		return qconf->n_rx_queue != 0;
+	case LCORE_ROLE_RX:
+		return reorder;
+	case LCORE_ROLE_WORKER:
+	case LCORE_ROLE_TX:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * TX queues of a port: one per lcore that sends, two with multi-segment
+ * TX, within what the NIC has and --tx-queues allows.
+ */
+static uint32_t
+get_port_n_tx_queues(uint8_t portid)
+{
+	struct rte_eth_dev_info dev_info;
+	unsigned lcore_id, per_lcore, n, max;
+
+	per_lcore = tx_mseg ? 2 : 1;
+	n = 0;
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++)
+		n += lcore_sends(lcore_id);
+
+	rte_eth_dev_info_get(portid, &dev_info);
+	max = RTE_MIN(max_tx_queues, (unsigned)dev_info.max_tx_queues);
+	max = RTE_MIN(max, MAX_TX_QUEUE_PER_PORT) / per_lcore;
+	if (max == 0 && n != 0)
+		rte_exit(EXIT_FAILURE, "port %hhu has %hu TX queues, %u needed\n",
+			portid, dev_info.max_tx_queues, per_lcore);
+	if (n > max) {
+		if (nb_tx_lcores != 0)
+			rte_exit(EXIT_FAILURE, "port %hhu has TX queues for %u"
+				" tx lcores only\n", portid, max);
+		printf("%u lcores share %u TX queues of port %hhu... ", n,
+			max * per_lcore, portid);
+	}
+	return RTE_MIN(n, max) * per_lcore;
+}
+
+/*
+ * Let an lcore left without a TX queue on a port send through the ring of
+ * the port, which the lcore owning its first queue drains.
+ */
+static void
+share_tx_queues(uint8_t portid, unsigned lcore_id)
+{
+	struct lcore_conf *owner = &lcore_conf[tx_queue_owner[portid]];
+	char name[RTE_RING_NAMESIZE];
+	int socketid;
+
+	printf("txq=%u,shared ", lcore_id);
+	if (port_tx_ring[portid] != NULL)
+		return;
+
+	socketid = numa_on ?
+		(int)rte_lcore_to_socket_id(tx_queue_owner[portid]) : 0;
+	rte_snprintf(name, sizeof(name), "tx_shared_%hhu", portid);
+	port_tx_ring[portid] = rte_ring_create(name, PIPELINE_RING_SIZE,
+		socketid, RING_F_SC_DEQ);
+	if (port_tx_ring[portid] == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot create ring %s\n", name);
+	owner->ring_port_id[owner->n_ring_port++] = portid;
+}
+
+/*
+ * With symmetric RSS both directions of a session land on the same queue
+ * index of their ports, hence on the same lcore only if each queue index
+ * is polled by one lcore on all the ports. Report where it is not, and the
+ * options that move queues or RETA buckets of one port only.
+ */
+static void
+check_symmetric_rss(void)
 {
-	uint16_t i, nb_rx_queue;
-	uint8_t lcore;
+	uint16_t i, j;
 
-	for (i = 0; i < nb_lcore_params; ++i) {
-		lcore = lcore_params[i].lcore_id;
-		nb_rx_queue = lcore_conf[lcore].n_rx_queue;
-		if (nb_rx_queue >= MAX_RX_QUEUE_PER_LCORE) {
-			printf("error: too many queues (%u) for lcore: %u\n",
-				(unsigned)nb_rx_queue + 1, (unsigned)lcore);
-			return -1;
-		} else {
-			lcore_conf[lcore].rx_queue_list[nb_rx_queue].port_id =
-				lcore_params[i].port_id;
-			lcore_conf[lcore].rx_queue_list[nb_rx_queue].queue_id =
-				lcore_params[i].queue_id;
-			lcore_conf[lcore].n_rx_queue++;
+	for (i = 0; i < nb_lcore_params; i++) {
+		for (j = i + 1; j < nb_lcore_params; j++) {
+			if (lcore_params[i].queue_id != lcore_params[j].queue_id ||
+					lcore_params[i].lcore_id == lcore_params[j].lcore_id)
+				continue;
+			printf("warning: symmetric RSS: rxqueue %hhu is polled by lcore"
+				" %hhu on port %hhu and lcore %hhu on port %hhu\n",
+				lcore_params[i].queue_id, lcore_params[i].lcore_id,
+				lcore_params[i].port_id, lcore_params[j].lcore_id,
+				lcore_params[j].port_id);
 		}
 	}
-	return 0;
+	if (rebalance_lcore >= 0)
+		printf("warning: symmetric RSS: --rebalance-lcore moves the queues"
+			" of one port at a time\n");
 }
 
 /* display usage */
@@ -1390,14 +4596,92 @@ print_usage(const char *prgname)
 		"  [--config (port,queue,lcore)[,(port,queue,lcore]]"
 		"  [--enable-jumbo [--max-pkt-len PKTLEN]]\n"
 		"  -p PORTMASK: hexadecimal bitmask of ports to configure\n"
-		"  -P : enable promiscuous mode\n"
+		"  -P : enable promiscuous mode, required by --calibrate-rings\n"
 		"  --config (port,queue,lcore): rx queues configuration\n"
 		"  --no-numa: optional, disable numa awareness\n"
 		"  --ipv6: optional, specify it if running ipv6 packets\n"
 		"  --enable-jumbo: enable jumbo frame"
 		" which max packet len is PKTLEN in decimal (64-9600)\n"
-		"  --hash-entry-num: specify the hash entry number in hexadecimal to be setup\n",
-		prgname);
+		"  --mbuf-seg-size SIZE: with jumbo frames, cap the mbuf data room"
+		" to SIZE bytes (%d-%d), longer frames are received as segment"
+		" chains (default: fit the max packet len)\n"
+		"  --hash-entry-num: specify the hash entry number in hexadecimal to be setup\n"
+		"  --table-policy POLICY: lookup table placement, replicated (default):"
+		" one copy per socket, shared: one copy for all sockets,"
+		" cached: shared copy behind per-lcore flow caches (exact match only)\n"
+		"  --fwd-kernel KERNEL: avx2, sse4.2 or scalar forwarding kernels,"
+		" default is the widest the CPU supports (vector kernels: exact match only,"
+		" all of them need SSE4.2)\n"
+		"  --ip-families ipv4|ipv6|both: IP versions to forward, others are"
+		" dropped (default both)\n"
+		"  --no-rfc1812: skip the RFC 1812 checks and TTL/hop limit update\n"
+		"  --no-nat: do not look up ipv6 NAT rules (exact match only)\n"
+		"  --burst N: packets per RX poll, 1-%d (default %d)\n"
+		"  --tx-drain-us US: longest time a partial TX burst waits"
+		" (default %d)\n"
+		"  --tx-flush-thresh N: send partial TX bursts after an RX poll"
+		" round of fewer than N packets, higher favours latency,"
+		" 0 only drains on the timer (default %d)\n"
+		"  --rx-coalesce: gather the RX queues of an lcore into one burst"
+		" before forwarding\n"
+		"  --node-cycles: account the cycles spent in each forwarding"
+		" graph node, see the SIGUSR1 statistics\n"
+		"  --tx-policy drop|retry|hold: packets a full TX queue refuses"
+		" are dropped (default), sent again for up to the retry budget,"
+		" or held in the TX buffer for the next flush\n"
+		"  --tx-retry-us US: retry budget of the retry policy (default %d)\n"
+		"  --worker-lcores LIST: pipeline mode, the --config lcores only"
+		" receive and hand the packets to the worker lcores of LIST"
+		" (e.g. 2,4-6), which forward them\n"
+		"  --tx-lcores LIST: pipeline mode, workers queue the packets to"
+		" these lcores, which own the TX queues of the ports\n"
+		"  --sw-distribute: pipeline mode, spread the packets over the"
+		" workers by a software hash of the 5-tuple, for ports with a"
+		" single RX queue or no RSS\n"
+		"  --rebalance-lcore LCORE: move RX queues from busy to idle lcores"
+		" at runtime, LCORE runs the control loop\n"
+		"  --rebalance-ms MS: interval of the control loop (default %d)\n"
+		"  --reorder: pipeline mode, spread the packets over the workers by"
+		" load rather than by flow and restore their order before TX\n"
+		"  --reorder-timeout-us US: wait for a missing packet at most US"
+		" (default %d)\n"
+		"  --rss-fields LIST: packet fields RSS hashes, ip, tcp and udp"
+		" (ports), e.g. ip,tcp,udp (default ip)\n"
+		"  --symmetric-rss: hash both directions of a session alike, in"
+		" the NIC and with --sw-distribute\n"
+		"  --reta-rebalance: with --rebalance-lcore, also move RSS"
+		" redirection table buckets from busy to idle RX queues\n"
+		"  --auto-config: map the RX queues of the ports to the lcores of"
+		" their NUMA node, in place of --config\n"
+		"  --tx-queues N: TX queues per port at most, the lcores left"
+		" without one share a queue through a ring (default: one per"
+		" lcore that sends, as many as the NIC has)\n"
+		"  --idle-backoff: lcores that receive nothing pause between"
+		" polls, longer the longer they stay idle\n"
+		"  --idle-max-us US: longest pause (default %d)\n"
+		"  --cpufreq: with --idle-backoff, lower the frequency of the"
+		" cores of idle lcores\n"
+		"  --per-port-pool: one mbuf pool per port and socket rather"
+		" than per socket\n"
+		"  --rx-desc N, --tx-desc N: descriptors per RX and TX queue,"
+		" %d-%d (default %d and %d)\n"
+		"  --rx-thresh P,H,W, --tx-thresh P,H,W: prefetch, host and"
+		" write-back thresholds of the queues (default %d,%d,%d and"
+		" %d,%d,%d)\n"
+		"  --rx-free-thresh N, --tx-free-thresh N, --tx-rs-thresh N:"
+		" descriptor free and report status thresholds, 0 for the PMD"
+		" default (default %d, 0 and 0)\n"
+		"  --calibrate-rings: try several ring sizes and free thresholds"
+		" with synthetic frames at startup and keep the best, the ports"
+		" must be cross-connected or looped back and in promiscuous mode"
+		" (-P)\n",
+		prgname, MBUF_DATA_SIZE_DEFAULT, MAX_JUMBO_PKT_LEN,
+		MAX_PKT_BURST, MAX_PKT_BURST, BURST_TX_DRAIN_US,
+		MAX_PKT_BURST / 4, TX_RETRY_US, REBALANCE_INTERVAL_MS,
+		REORDER_TIMEOUT_US, IDLE_MAX_US, MIN_RING_DESC, MAX_RING_DESC,
+		RTE_TEST_RX_DESC_DEFAULT, RTE_TEST_TX_DESC_DEFAULT,
+		RX_PTHRESH, RX_HTHRESH, RX_WTHRESH, TX_PTHRESH, TX_HTHRESH,
+		TX_WTHRESH, RX_FREE_THRESH);
 }
 
 static int parse_max_pkt_len(const char *pktlen)
@@ -1451,6 +4735,151 @@ parse_hash_entry_number(const char *hash_entry_num)
 }
 #endif
 
+/* Parse a list of lcores such as "1,2,4-6" */
+static int
+parse_lcore_list(const char *list, uint8_t *lcores, uint16_t *nb_lcores)
+{
+	unsigned long first, last;
+	const char *p = list;
+	char *end;
+
+	*nb_lcores = 0;
+	while (*p != '\0') {
+		errno = 0;
+		first = strtoul(p, &end, 10);
+		if (errno != 0 || end == p || first >= RTE_MAX_LCORE)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if (errno != 0 || end == p || last >= RTE_MAX_LCORE ||
+					last < first)
+				return -1;
+		}
+		for (; first <= last; first++) {
+			if (*nb_lcores >= MAX_PIPELINE_LCORES)
+				return -1;
+			lcores[(*nb_lcores)++] = (uint8_t)first;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		p = end;
+	}
+	return *nb_lcores == 0 ? -1 : 0;
+}
+
+/* Parse the RSS fields: a list of ip, tcp and udp */
+static int
+parse_rss_fields(const char *fields, uint16_t *rss_hf)
+{
+	char s[64], *str_fld[3];
+	int i, n;
+
+	rte_snprintf(s, sizeof(s), "%s", fields);
+	n = rte_strsplit(s, sizeof(s), str_fld, 3, ',');
+	if (n <= 0)
+		return -1;
+
+	*rss_hf = 0;
+	for (i = 0; i < n; i++) {
+		if (strcmp(str_fld[i], "ip") == 0)
+			*rss_hf |= ETH_RSS_IPV4 | ETH_RSS_IPV6;
+		else if (strcmp(str_fld[i], "tcp") == 0)
+			*rss_hf |= ETH_RSS_IPV4_TCP | ETH_RSS_IPV6_TCP;
+		else if (strcmp(str_fld[i], "udp") == 0)
+			*rss_hf |= ETH_RSS_IPV4_UDP | ETH_RSS_IPV6_UDP;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+static int
+parse_tx_policy(const char *policy)
+{
+	int i;
+
+	for (i = 0; i < TX_POLICY_MAX; i++) {
+		if (strcmp(policy, tx_policy_name[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int
+parse_table_policy(const char *policy)
+{
+	int i;
+
+	for (i = 0; i < TABLE_POLICY_MAX; i++) {
+		if (strcmp(policy, table_policy_name[i]) == 0)
+			break;
+	}
+	if (i == TABLE_POLICY_MAX)
+		return -1;
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_LPM)
+	if (i == TABLE_POLICY_CACHED) {
+		printf("flow cache needs exact match lookup, using shared tables\n");
+		i = TABLE_POLICY_SHARED;
+	}
+#endif
+	return i;
+}
+
+static int
+parse_ip_families(const char *families)
+{
+	if (strcmp(families, "ipv4") == 0)
+		return FWD_F_IPV4;
+	if (strcmp(families, "ipv6") == 0)
+		return FWD_F_IPV6;
+	if (strcmp(families, "both") == 0)
+		return FWD_F_IPV4 | FWD_F_IPV6;
+	return -1;
+}
+
+/* Parse a decimal number in [min, max] */
+static int
+parse_uint_arg(const char *arg, unsigned long min, unsigned long max)
+{
+	char *end = NULL;
+	unsigned long n;
+
+	/* parse decimal string */
+	n = strtoul(arg, &end, 10);
+	if ((arg[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return -1;
+
+	if (n < min || n > max)
+		return -1;
+
+	return n;
+}
+
+/* Parse the prefetch, host and write-back thresholds "P,H,W" */
+static int
+parse_thresh(const char *arg, struct rte_eth_thresh *thresh)
+{
+	char s[64], *str_fld[3];
+	int i, val[3];
+
+	rte_snprintf(s, sizeof(s), "%s", arg);
+	if (rte_strsplit(s, sizeof(s), str_fld, 3, ',') != 3)
+		return -1;
+	for (i = 0; i < 3; i++) {
+		val[i] = parse_uint_arg(str_fld[i], 0, UINT8_MAX);
+		if (val[i] < 0)
+			return -1;
+	}
+	thresh->pthresh = (uint8_t)val[0];
+	thresh->hthresh = (uint8_t)val[1];
+	thresh->wthresh = (uint8_t)val[2];
+	return 0;
+}
+
 static int
 parse_config(const char *q_arg)
 {
@@ -1507,6 +4936,43 @@ parse_config(const char *q_arg)
 #define CMD_LINE_OPT_IPV6 "ipv6"
 #define CMD_LINE_OPT_ENABLE_JUMBO "enable-jumbo"
 #define CMD_LINE_OPT_HASH_ENTRY_NUM "hash-entry-num"
+#define CMD_LINE_OPT_TABLE_POLICY "table-policy"
+#define CMD_LINE_OPT_FWD_KERNEL "fwd-kernel"
+#define CMD_LINE_OPT_IP_FAMILIES "ip-families"
+#define CMD_LINE_OPT_NO_RFC1812 "no-rfc1812"
+#define CMD_LINE_OPT_NO_NAT "no-nat"
+#define CMD_LINE_OPT_BURST "burst"
+#define CMD_LINE_OPT_TX_DRAIN_US "tx-drain-us"
+#define CMD_LINE_OPT_TX_FLUSH_THRESH "tx-flush-thresh"
+#define CMD_LINE_OPT_RX_COALESCE "rx-coalesce"
+#define CMD_LINE_OPT_NODE_CYCLES "node-cycles"
+#define CMD_LINE_OPT_MBUF_SEG_SIZE "mbuf-seg-size"
+#define CMD_LINE_OPT_TX_POLICY "tx-policy"
+#define CMD_LINE_OPT_TX_RETRY_US "tx-retry-us"
+#define CMD_LINE_OPT_WORKER_LCORES "worker-lcores"
+#define CMD_LINE_OPT_TX_LCORES "tx-lcores"
+#define CMD_LINE_OPT_SW_DISTRIBUTE "sw-distribute"
+#define CMD_LINE_OPT_REBALANCE_LCORE "rebalance-lcore"
+#define CMD_LINE_OPT_REBALANCE_MS "rebalance-ms"
+#define CMD_LINE_OPT_REORDER "reorder"
+#define CMD_LINE_OPT_REORDER_TIMEOUT_US "reorder-timeout-us"
+#define CMD_LINE_OPT_TX_QUEUES "tx-queues"
+#define CMD_LINE_OPT_AUTO_CONFIG "auto-config"
+#define CMD_LINE_OPT_RSS_FIELDS "rss-fields"
+#define CMD_LINE_OPT_RETA_REBALANCE "reta-rebalance"
+#define CMD_LINE_OPT_SYMMETRIC_RSS "symmetric-rss"
+#define CMD_LINE_OPT_IDLE_BACKOFF "idle-backoff"
+#define CMD_LINE_OPT_IDLE_MAX_US "idle-max-us"
+#define CMD_LINE_OPT_CPUFREQ "cpufreq"
+#define CMD_LINE_OPT_PER_PORT_POOL "per-port-pool"
+#define CMD_LINE_OPT_RX_DESC "rx-desc"
+#define CMD_LINE_OPT_TX_DESC "tx-desc"
+#define CMD_LINE_OPT_RX_THRESH "rx-thresh"
+#define CMD_LINE_OPT_TX_THRESH "tx-thresh"
+#define CMD_LINE_OPT_RX_FREE_THRESH "rx-free-thresh"
+#define CMD_LINE_OPT_TX_FREE_THRESH "tx-free-thresh"
+#define CMD_LINE_OPT_TX_RS_THRESH "tx-rs-thresh"
+#define CMD_LINE_OPT_CALIBRATE_RINGS "calibrate-rings"
 
 /* Parse the argument given in the command line of the application */
 static int
@@ -1522,6 +4988,43 @@ parse_args(int argc, char **argv)
 		{CMD_LINE_OPT_IPV6, 0, 0, 0},
 		{CMD_LINE_OPT_ENABLE_JUMBO, 0, 0, 0},
 		{CMD_LINE_OPT_HASH_ENTRY_NUM, 1, 0, 0},
+		{CMD_LINE_OPT_TABLE_POLICY, 1, 0, 0},
+		{CMD_LINE_OPT_FWD_KERNEL, 1, 0, 0},
+		{CMD_LINE_OPT_IP_FAMILIES, 1, 0, 0},
+		{CMD_LINE_OPT_NO_RFC1812, 0, 0, 0},
+		{CMD_LINE_OPT_NO_NAT, 0, 0, 0},
+		{CMD_LINE_OPT_BURST, 1, 0, 0},
+		{CMD_LINE_OPT_TX_DRAIN_US, 1, 0, 0},
+		{CMD_LINE_OPT_TX_FLUSH_THRESH, 1, 0, 0},
+		{CMD_LINE_OPT_RX_COALESCE, 0, 0, 0},
+		{CMD_LINE_OPT_NODE_CYCLES, 0, 0, 0},
+		{CMD_LINE_OPT_MBUF_SEG_SIZE, 1, 0, 0},
+		{CMD_LINE_OPT_TX_POLICY, 1, 0, 0},
+		{CMD_LINE_OPT_TX_RETRY_US, 1, 0, 0},
+		{CMD_LINE_OPT_WORKER_LCORES, 1, 0, 0},
+		{CMD_LINE_OPT_TX_LCORES, 1, 0, 0},
+		{CMD_LINE_OPT_SW_DISTRIBUTE, 0, 0, 0},
+		{CMD_LINE_OPT_REBALANCE_LCORE, 1, 0, 0},
+		{CMD_LINE_OPT_REBALANCE_MS, 1, 0, 0},
+		{CMD_LINE_OPT_REORDER, 0, 0, 0},
+		{CMD_LINE_OPT_REORDER_TIMEOUT_US, 1, 0, 0},
+		{CMD_LINE_OPT_TX_QUEUES, 1, 0, 0},
+		{CMD_LINE_OPT_AUTO_CONFIG, 0, 0, 0},
+		{CMD_LINE_OPT_RSS_FIELDS, 1, 0, 0},
+		{CMD_LINE_OPT_RETA_REBALANCE, 0, 0, 0},
+		{CMD_LINE_OPT_SYMMETRIC_RSS, 0, 0, 0},
+		{CMD_LINE_OPT_IDLE_BACKOFF, 0, 0, 0},
+		{CMD_LINE_OPT_IDLE_MAX_US, 1, 0, 0},
+		{CMD_LINE_OPT_CPUFREQ, 0, 0, 0},
+		{CMD_LINE_OPT_PER_PORT_POOL, 0, 0, 0},
+		{CMD_LINE_OPT_RX_DESC, 1, 0, 0},
+		{CMD_LINE_OPT_TX_DESC, 1, 0, 0},
+		{CMD_LINE_OPT_RX_THRESH, 1, 0, 0},
+		{CMD_LINE_OPT_TX_THRESH, 1, 0, 0},
+		{CMD_LINE_OPT_RX_FREE_THRESH, 1, 0, 0},
+		{CMD_LINE_OPT_TX_FREE_THRESH, 1, 0, 0},
+		{CMD_LINE_OPT_TX_RS_THRESH, 1, 0, 0},
+		{CMD_LINE_OPT_CALIBRATE_RINGS, 0, 0, 0},
 		{NULL, 0, 0, 0}
 	};
 
@@ -1557,54 +5060,397 @@ parse_args(int argc, char **argv)
 				}
 			}
 
-			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_NO_NUMA, 
-				sizeof(CMD_LINE_OPT_NO_NUMA))) {
-				printf("numa is disabled \n");
-				numa_on = 0;
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_NO_NUMA, 
+				sizeof(CMD_LINE_OPT_NO_NUMA))) {
+				printf("numa is disabled \n");
+				numa_on = 0;
+			}
+			
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)	
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_IPV6, 
+				sizeof(CMD_LINE_OPT_IPV6))) {
+				printf("ipv6 is specified \n");
+				ipv6 = 1;
+			}
+#endif
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_ENABLE_JUMBO, 
+				sizeof (CMD_LINE_OPT_ENABLE_JUMBO))) {
+				struct option lenopts = {"max-pkt-len", required_argument, 0, 0};
+
+				printf("jumbo frame is enabled\n");
+				port_conf.rxmode.jumbo_frame = 1;
+	
+				/* if no max-pkt-len set, use the default value ETHER_MAX_LEN */	
+				if (0 == getopt_long(argc, argvopt, "", &lenopts, &option_index)) {
+					ret = parse_max_pkt_len(optarg);
+					if ((ret < 64) || (ret > MAX_JUMBO_PKT_LEN)){
+						printf("invalid packet length\n");
+						print_usage(prgname);
+						return -1;
+					}
+					port_conf.rxmode.max_rx_pkt_len = ret;
+				}
+				printf("set jumbo frame max packet length to %u\n", 
+						(unsigned int)port_conf.rxmode.max_rx_pkt_len);
+			}
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_HASH_ENTRY_NUM, 
+				sizeof(CMD_LINE_OPT_HASH_ENTRY_NUM))) {
+				ret = parse_hash_entry_number(optarg);
+				if ((ret > 0) && (ret <= L3FWD_HASH_ENTRIES)) {
+					hash_entry_number = ret;
+				} else {
+					printf("invalid hash entry number\n");
+					print_usage(prgname);
+					return -1;
+				}
+			}
+#endif
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TABLE_POLICY,
+				sizeof(CMD_LINE_OPT_TABLE_POLICY))) {
+				ret = parse_table_policy(optarg);
+				if (ret < 0) {
+					printf("invalid table policy\n");
+					print_usage(prgname);
+					return -1;
+				}
+				table_policy = (enum table_policy)ret;
+				printf("lookup table policy is %s\n",
+					table_policy_name[table_policy]);
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_FWD_KERNEL,
+				sizeof(CMD_LINE_OPT_FWD_KERNEL))) {
+				fwd_isa_req = parse_fwd_kernel(optarg);
+				if (fwd_isa_req < 0) {
+					printf("invalid forwarding kernel\n");
+					print_usage(prgname);
+					return -1;
+				}
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_IP_FAMILIES,
+				sizeof(CMD_LINE_OPT_IP_FAMILIES))) {
+				ret = parse_ip_families(optarg);
+				if (ret < 0) {
+					printf("invalid ip families\n");
+					print_usage(prgname);
+					return -1;
+				}
+				fwd_flags = (fwd_flags & ~(FWD_F_IPV4 | FWD_F_IPV6)) | ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_NO_RFC1812,
+				sizeof(CMD_LINE_OPT_NO_RFC1812))) {
+				printf("RFC 1812 checks are disabled\n");
+				fwd_flags &= ~FWD_F_RFC1812;
+			}
+
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_NO_NAT,
+				sizeof(CMD_LINE_OPT_NO_NAT))) {
+				printf("ipv6 NAT is disabled\n");
+				fwd_flags &= ~FWD_F_NAT;
+			}
+#endif
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_BURST,
+				sizeof(CMD_LINE_OPT_BURST))) {
+				ret = parse_uint_arg(optarg, 1, MAX_PKT_BURST);
+				if (ret < 0) {
+					printf("invalid burst size\n");
+					print_usage(prgname);
+					return -1;
+				}
+				rx_burst_size = (uint16_t)ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_DRAIN_US,
+				sizeof(CMD_LINE_OPT_TX_DRAIN_US))) {
+				ret = parse_uint_arg(optarg, 1, US_PER_S);
+				if (ret < 0) {
+					printf("invalid tx drain period\n");
+					print_usage(prgname);
+					return -1;
+				}
+				tx_drain_us = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_FLUSH_THRESH,
+				sizeof(CMD_LINE_OPT_TX_FLUSH_THRESH))) {
+				ret = parse_uint_arg(optarg, 0,
+					MAX_PKT_BURST * MAX_RX_QUEUE_PER_LCORE);
+				if (ret < 0) {
+					printf("invalid tx flush threshold\n");
+					print_usage(prgname);
+					return -1;
+				}
+				tx_flush_thresh = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_RX_COALESCE,
+				sizeof(CMD_LINE_OPT_RX_COALESCE))) {
+				printf("RX queues are coalesced into one burst per lcore\n");
+				rx_coalesce = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_NODE_CYCLES,
+				sizeof(CMD_LINE_OPT_NODE_CYCLES))) {
+				printf("cycles are accounted per graph node\n");
+				node_cycles = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_MBUF_SEG_SIZE,
+				sizeof(CMD_LINE_OPT_MBUF_SEG_SIZE))) {
+				ret = parse_uint_arg(optarg, MBUF_DATA_SIZE_DEFAULT,
+					MAX_JUMBO_PKT_LEN);
+				if (ret < 0) {
+					printf("invalid mbuf segment size\n");
+					print_usage(prgname);
+					return -1;
+				}
+				mbuf_seg_size = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_POLICY,
+				sizeof(CMD_LINE_OPT_TX_POLICY))) {
+				ret = parse_tx_policy(optarg);
+				if (ret < 0) {
+					printf("invalid tx policy\n");
+					print_usage(prgname);
+					return -1;
+				}
+				tx_policy = (enum tx_policy)ret;
+				printf("tx policy is %s\n", tx_policy_name[tx_policy]);
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_RETRY_US,
+				sizeof(CMD_LINE_OPT_TX_RETRY_US))) {
+				ret = parse_uint_arg(optarg, 1, US_PER_S);
+				if (ret < 0) {
+					printf("invalid tx retry budget\n");
+					print_usage(prgname);
+					return -1;
+				}
+				tx_retry_us = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_WORKER_LCORES,
+				sizeof(CMD_LINE_OPT_WORKER_LCORES))) {
+				if (parse_lcore_list(optarg, worker_lcores,
+						&nb_worker_lcores) < 0) {
+					printf("invalid worker lcore list\n");
+					print_usage(prgname);
+					return -1;
+				}
+				printf("pipeline mode with %hu workers\n",
+					nb_worker_lcores);
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_LCORES,
+				sizeof(CMD_LINE_OPT_TX_LCORES))) {
+				if (parse_lcore_list(optarg, tx_lcores,
+						&nb_tx_lcores) < 0) {
+					printf("invalid tx lcore list\n");
+					print_usage(prgname);
+					return -1;
+				}
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_SW_DISTRIBUTE,
+				sizeof(CMD_LINE_OPT_SW_DISTRIBUTE))) {
+				printf("packets are spread by a software flow hash\n");
+				sw_distribute = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_REBALANCE_LCORE,
+				sizeof(CMD_LINE_OPT_REBALANCE_LCORE))) {
+				ret = parse_uint_arg(optarg, 0, RTE_MAX_LCORE - 1);
+				if (ret < 0) {
+					printf("invalid control lcore\n");
+					print_usage(prgname);
+					return -1;
+				}
+				rebalance_lcore = ret;
+				printf("RX queues are rebalanced by lcore %d\n", ret);
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_REBALANCE_MS,
+				sizeof(CMD_LINE_OPT_REBALANCE_MS))) {
+				ret = parse_uint_arg(optarg, 1, MS_PER_S);
+				if (ret < 0) {
+					printf("invalid rebalance interval\n");
+					print_usage(prgname);
+					return -1;
+				}
+				rebalance_ms = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_REORDER,
+				sizeof(CMD_LINE_OPT_REORDER))) {
+				printf("packets are spread by load and reordered\n");
+				reorder = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_REORDER_TIMEOUT_US,
+				sizeof(CMD_LINE_OPT_REORDER_TIMEOUT_US))) {
+				ret = parse_uint_arg(optarg, 1, US_PER_S);
+				if (ret < 0) {
+					printf("invalid reorder timeout\n");
+					print_usage(prgname);
+					return -1;
+				}
+				reorder_timeout_us = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_QUEUES,
+				sizeof(CMD_LINE_OPT_TX_QUEUES))) {
+				ret = parse_uint_arg(optarg, 1, MAX_TX_QUEUE_PER_PORT);
+				if (ret < 0) {
+					printf("invalid number of tx queues\n");
+					print_usage(prgname);
+					return -1;
+				}
+				max_tx_queues = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_AUTO_CONFIG,
+				sizeof(CMD_LINE_OPT_AUTO_CONFIG))) {
+				printf("RX queues are mapped from the NUMA topology\n");
+				auto_config = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_RSS_FIELDS,
+				sizeof(CMD_LINE_OPT_RSS_FIELDS))) {
+				if (parse_rss_fields(optarg,
+						&port_conf.rx_adv_conf.rss_conf.rss_hf) < 0) {
+					printf("invalid rss fields\n");
+					print_usage(prgname);
+					return -1;
+				}
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_RETA_REBALANCE,
+				sizeof(CMD_LINE_OPT_RETA_REBALANCE))) {
+				printf("RETA buckets are rebalanced\n");
+				reta_rebalance = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_SYMMETRIC_RSS,
+				sizeof(CMD_LINE_OPT_SYMMETRIC_RSS))) {
+				printf("RSS is symmetric\n");
+				symmetric_rss = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_IDLE_BACKOFF,
+				sizeof(CMD_LINE_OPT_IDLE_BACKOFF))) {
+				printf("idle lcores back off\n");
+				idle_backoff = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_IDLE_MAX_US,
+				sizeof(CMD_LINE_OPT_IDLE_MAX_US))) {
+				ret = parse_uint_arg(optarg, 1, US_PER_S);
+				if (ret < 0) {
+					printf("invalid idle pause\n");
+					print_usage(prgname);
+					return -1;
+				}
+				idle_max_us = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_CPUFREQ,
+				sizeof(CMD_LINE_OPT_CPUFREQ))) {
+				printf("idle lcores lower their frequency\n");
+				cpufreq = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_PER_PORT_POOL,
+				sizeof(CMD_LINE_OPT_PER_PORT_POOL))) {
+				printf("mbuf pools per port\n");
+				per_port_pool = 1;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_RX_DESC,
+				sizeof(CMD_LINE_OPT_RX_DESC))) {
+				ret = parse_uint_arg(optarg, MIN_RING_DESC, MAX_RING_DESC);
+				if (ret < 0) {
+					printf("invalid number of rx descriptors\n");
+					print_usage(prgname);
+					return -1;
+				}
+				nb_rxd = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_DESC,
+				sizeof(CMD_LINE_OPT_TX_DESC))) {
+				ret = parse_uint_arg(optarg, MIN_RING_DESC, MAX_RING_DESC);
+				if (ret < 0) {
+					printf("invalid number of tx descriptors\n");
+					print_usage(prgname);
+					return -1;
+				}
+				nb_txd = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_RX_THRESH,
+				sizeof(CMD_LINE_OPT_RX_THRESH))) {
+				if (parse_thresh(optarg, &rx_conf.rx_thresh) < 0) {
+					printf("invalid rx thresholds\n");
+					print_usage(prgname);
+					return -1;
+				}
 			}
-			
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)	
-			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_IPV6, 
-				sizeof(CMD_LINE_OPT_IPV6))) {
-				printf("ipv6 is specified \n");
-				ipv6 = 1;
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_THRESH,
+				sizeof(CMD_LINE_OPT_TX_THRESH))) {
+				if (parse_thresh(optarg, &tx_conf.tx_thresh) < 0) {
+					printf("invalid tx thresholds\n");
+					print_usage(prgname);
+					return -1;
+				}
 			}
-#endif
 
-			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_ENABLE_JUMBO, 
-				sizeof (CMD_LINE_OPT_ENABLE_JUMBO))) {
-				struct option lenopts = {"max-pkt-len", required_argument, 0, 0};
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_RX_FREE_THRESH,
+				sizeof(CMD_LINE_OPT_RX_FREE_THRESH))) {
+				ret = parse_uint_arg(optarg, 0, MAX_RING_DESC);
+				if (ret < 0) {
+					printf("invalid rx free threshold\n");
+					print_usage(prgname);
+					return -1;
+				}
+				rx_conf.rx_free_thresh = ret;
+			}
 
-				printf("jumbo frame is enabled - disabling simple TX path\n");
-				port_conf.rxmode.jumbo_frame = 1;
-				tx_conf.txq_flags = 0;
-	
-				/* if no max-pkt-len set, use the default value ETHER_MAX_LEN */	
-				if (0 == getopt_long(argc, argvopt, "", &lenopts, &option_index)) {
-					ret = parse_max_pkt_len(optarg);
-					if ((ret < 64) || (ret > MAX_JUMBO_PKT_LEN)){
-						printf("invalid packet length\n");
-						print_usage(prgname);
-						return -1;
-					}
-					port_conf.rxmode.max_rx_pkt_len = ret;
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_FREE_THRESH,
+				sizeof(CMD_LINE_OPT_TX_FREE_THRESH))) {
+				ret = parse_uint_arg(optarg, 0, MAX_RING_DESC);
+				if (ret < 0) {
+					printf("invalid tx free threshold\n");
+					print_usage(prgname);
+					return -1;
 				}
-				printf("set jumbo frame max packet length to %u\n", 
-						(unsigned int)port_conf.rxmode.max_rx_pkt_len);
+				tx_conf.tx_free_thresh = ret;
 			}
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
-			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_HASH_ENTRY_NUM, 
-				sizeof(CMD_LINE_OPT_HASH_ENTRY_NUM))) {
-				ret = parse_hash_entry_number(optarg);
-				if ((ret > 0) && (ret <= L3FWD_HASH_ENTRIES)) {
-					hash_entry_number = ret;
-				} else {
-					printf("invalid hash entry number\n");
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_TX_RS_THRESH,
+				sizeof(CMD_LINE_OPT_TX_RS_THRESH))) {
+				ret = parse_uint_arg(optarg, 0, MAX_RING_DESC);
+				if (ret < 0) {
+					printf("invalid tx rs threshold\n");
 					print_usage(prgname);
 					return -1;
 				}
+				tx_conf.tx_rs_thresh = ret;
+			}
+
+			if (!strncmp(lgopts[option_index].name, CMD_LINE_OPT_CALIBRATE_RINGS,
+				sizeof(CMD_LINE_OPT_CALIBRATE_RINGS))) {
+				printf("rings are calibrated at startup\n");
+				calibrate_rings = 1;
 			}
-#endif
 			break;
 
 		default:
@@ -1613,6 +5459,25 @@ parse_args(int argc, char **argv)
 		}
 	}
 
+	if (symmetric_rss && reta_rebalance) {
+		printf("--reta-rebalance would break the symmetry of RSS\n");
+		print_usage(prgname);
+		return -1;
+	}
+
+	if (auto_config && lcore_params == lcore_params_array) {
+		printf("--config and --auto-config are exclusive\n");
+		print_usage(prgname);
+		return -1;
+	}
+
+	/* the frames go to 02:00:00:00:00:<port>, not the peer's address */
+	if (calibrate_rings && !promiscuous_on) {
+		printf("--calibrate-rings requires -P\n");
+		print_usage(prgname);
+		return -1;
+	}
+
 	if (optind >= 0)
 		argv[optind-1] = prgname;
 
@@ -1666,17 +5531,30 @@ static void convert_ipv6_5tuple(struct ipv6_5tuple* key1,
 	return;
 }
 
+/* Key masks of the lookups, set once before the tables are built */
+static void
+init_em_masks(void)
+{
+	mask0 = _mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS, BIT_8_TO_15);
+	mask1 = _mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS, BIT_16_TO_23);
+	mask2 = _mm_set_epi32(0, 0, ALL_32_BITS, ALL_32_BITS);
+	mask3 = _mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS, 0);
+	mask4 = _mm_set_epi32(0, 0, 0, ALL_32_BITS);
+}
+
+/*
+ * The populate functions add the keys to the hash of one socket. With
+ * first set they also fill the output port and NAT arrays the sockets
+ * share, and report what they added.
+ */
 #define BYTE_VALUE_MAX 256
-#define ALL_32_BITS 0xffffffff
-#define BIT_8_TO_15 0x0000ff00
 static inline void
-populate_ipv4_few_flow_into_table(const struct rte_hash* h)
+populate_ipv4_few_flow_into_table(const struct rte_hash* h, const int first)
 {
 	uint32_t i;
 	int32_t ret;
 	uint32_t array_len = sizeof(ipv4_l3fwd_route_array)/sizeof(ipv4_l3fwd_route_array[0]); 
 
-	mask0 = _mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS, BIT_8_TO_15);
 	for (i = 0; i < array_len; i++) {
 		struct ipv4_l3fwd_route  entry;
 		union ipv4_5tuple_host newkey;
@@ -1687,24 +5565,21 @@ populate_ipv4_few_flow_into_table(const struct rte_hash* h)
 			rte_exit(EXIT_FAILURE, "Unable to add entry %u to the"
                                 "l3fwd hash.\n", i);
 		}
-		ipv4_l3fwd_out_if[ret] = entry.if_out;
+		if (first)
+			ipv4_l3fwd_out_if[ret] = entry.if_out;
 	}
-	printf("Hash: Adding IPv4 0x%x keys\n", array_len);
+	if (first)
+		printf("Hash: Adding IPv4 0x%x keys\n", array_len);
 }
 
-#define BIT_16_TO_23 0x00ff0000
 static inline void
-populate_ipv6_few_flow_into_table(const struct rte_hash* h)
+populate_ipv6_few_flow_into_table(const struct rte_hash* h, const int first)
 {
 	uint32_t i;
 	int32_t ret;
 	uint32_t array_len = sizeof(ipv6_l3fwd_route_array)/sizeof(ipv6_l3fwd_route_array[0]); 
 	uint32_t nat_array_len = sizeof(ipv6_nat_route_array)/sizeof(ipv6_nat_route_array[0]);
 
-	mask1 = _mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS, BIT_16_TO_23);
-	mask2 = _mm_set_epi32(0, 0, ALL_32_BITS, ALL_32_BITS);
-	mask3 = _mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS, 0);
-	mask4 = _mm_set_epi32(0, 0, 0, ALL_32_BITS);
 	for (i = 0; i < array_len; i++) {
 		struct ipv6_l3fwd_route entry;
 		union ipv6_5tuple_host newkey;
@@ -1715,9 +5590,11 @@ populate_ipv6_few_flow_into_table(const struct rte_hash* h)
 			rte_exit(EXIT_FAILURE, "Unable to add entry %u to the"
                                 "l3fwd hash.\n", i);
 		}
-		ipv6_l3fwd_out_if[ret] = entry.if_out;
+		if (first)
+			ipv6_l3fwd_out_if[ret] = entry.if_out;
 	}
-	RTE_LOG(INFO, L3FWD,"Hash: Adding IPv6 Route 0x%xkeys\n", array_len);
+	if (first)
+		RTE_LOG(INFO, L3FWD,"Hash: Adding IPv6 Route 0x%xkeys\n", array_len);
 
 	/* Adding nat rules into hash. */
 	for (i = 0; i < nat_array_len; i++) {
@@ -1730,19 +5607,27 @@ populate_ipv6_few_flow_into_table(const struct rte_hash* h)
 	        rte_exit(EXIT_FAILURE, "Unable to add entry %u to the"
 		                           "l3fwd hash.\n", i);
 		}
+		if (!first)
+			continue;
 		ipv6_nat_rules[ret] = entry.rule;
 		RTE_LOG(INFO, L3FWD,"adding %d port to array\n", entry.rule.if_out);
 	}
-	RTE_LOG(INFO, L3FWD,"Hash: Adding IPv6 Nat 0x%xkeys\n", nat_array_len);
+	if (first)
+		RTE_LOG(INFO, L3FWD,"Hash: Adding IPv6 Nat 0x%xkeys\n", nat_array_len);
 }
 
 #define NUMBER_PORT_USED 4
-static inline void
+/*
+ * Keys whose bucket is already full are skipped and counted rather than
+ * treated as fatal, so that the fill level of large tables can be studied.
+ * Returns the number of keys that could not be added.
+ */
+static inline uint32_t
 populate_ipv4_many_flow_into_table(const struct rte_hash* h,
-                unsigned int nr_flow)
+                unsigned int nr_flow, const int first)
 {
 	unsigned i;
-	mask0 = _mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS, BIT_8_TO_15);
+	uint32_t failures = 0;
 	for (i = 0; i < nr_flow; i++) {
 		struct ipv4_l3fwd_route entry;
 		union ipv4_5tuple_host newkey;
@@ -1771,22 +5656,29 @@ populate_ipv4_many_flow_into_table(const struct rte_hash* h,
 		};
 		convert_ipv4_5tuple(&entry.key, &newkey);
 		int32_t ret = rte_hash_add_key(h,(void *) &newkey);
+		if (ret == -ENOSPC) {
+			failures++;
+			continue;
+		}
 		if (ret < 0) {
 			rte_exit(EXIT_FAILURE, "Unable to add entry %u\n", i);
 		}
-		ipv4_l3fwd_out_if[ret] = (uint8_t) entry.if_out;
+		if (first)
+			ipv4_l3fwd_out_if[ret] = (uint8_t) entry.if_out;
 
 	}
-	RTE_LOG(INFO, L3FWD,"Hash: Adding 0x%x keys\n", nr_flow);
+	if (first)
+		RTE_LOG(INFO, L3FWD,"Hash: Adding 0x%x keys, %u failed\n", nr_flow,
+			failures);
+	return failures;
 }
 
-static inline void
+static inline uint32_t
 populate_ipv6_many_flow_into_table(const struct rte_hash* h,
-                unsigned int nr_flow)
+                unsigned int nr_flow, const int first)
 {
 	unsigned i;
-	mask1 = _mm_set_epi32(ALL_32_BITS, ALL_32_BITS, ALL_32_BITS, BIT_16_TO_23);
-	mask2 = _mm_set_epi32(0, 0, ALL_32_BITS, ALL_32_BITS);
+	uint32_t failures = 0;
 	for (i = 0; i < nr_flow; i++) {
 		struct ipv6_l3fwd_route entry;
 		union ipv6_5tuple_host newkey;
@@ -1806,17 +5698,25 @@ populate_ipv6_many_flow_into_table(const struct rte_hash* h,
 		entry.key.ip_dst[15] = a;
 		convert_ipv6_5tuple(&entry.key, &newkey);
 		int32_t ret = rte_hash_add_key(h,(void *) &newkey);
+		if (ret == -ENOSPC) {
+			failures++;
+			continue;
+		}
 		if (ret < 0) {
 			rte_exit(EXIT_FAILURE, "Unable to add entry %u\n", i);
 		}
-		ipv6_l3fwd_out_if[ret] = (uint8_t) entry.if_out;
+		if (first)
+			ipv6_l3fwd_out_if[ret] = (uint8_t) entry.if_out;
 
 	}
-	printf("Hash: Adding 0x%x keys\n", nr_flow);
+	if (first)
+		printf("Hash: Adding 0x%x keys, %u failed\n", nr_flow, failures);
+	return failures;
 }
 
+/* Create the empty hash tables of a socket */
 static void
-setup_hash(int socketid)
+create_hash(int socketid)
 {
     struct rte_hash_parameters ipv4_l3fwd_hash_params = {
         .name = NULL,
@@ -1855,39 +5755,56 @@ setup_hash(int socketid)
 	if (ipv6_l3fwd_lookup_struct[socketid] == NULL)
 		rte_exit(EXIT_FAILURE, "Unable to create the l3fwd hash on "
 				"socket %d\n", socketid);
+}
 
+/* Populate the hash tables of a socket */
+static void
+setup_hash(int socketid, const int first)
+{
 	if (hash_entry_number != HASH_ENTRY_NUMBER_DEFAULT) {
 		/* For testing hash matching with a large number of flows we
 		 * generate millions of IP 5-tuples with an incremented dst
 		 * address to initialize the hash table. */
 		if (ipv6 == 0) {
 			/* populate the ipv4 hash */
-			populate_ipv4_many_flow_into_table(
-				ipv4_l3fwd_lookup_struct[socketid], hash_entry_number);
+			ipv4_em_info[socketid].add_failures =
+				populate_ipv4_many_flow_into_table(
+				ipv4_l3fwd_lookup_struct[socketid], hash_entry_number,
+				first);
 		} else {
 			/* populate the ipv6 hash */
-			populate_ipv6_many_flow_into_table(
-				ipv6_l3fwd_lookup_struct[socketid], hash_entry_number);
+			ipv6_em_info[socketid].add_failures =
+				populate_ipv6_many_flow_into_table(
+				ipv6_l3fwd_lookup_struct[socketid], hash_entry_number,
+				first);
 		}
 	} else {
 		/* Use data in ipv4/ipv6 l3fwd lookup table directly to initialize the hash table */
 		/* populate the ipv4 hash */
-		populate_ipv4_few_flow_into_table(ipv4_l3fwd_lookup_struct[socketid]);
+		populate_ipv4_few_flow_into_table(ipv4_l3fwd_lookup_struct[socketid],
+			first);
 		/* populate the ipv6 hash */
-		populate_ipv6_few_flow_into_table(ipv6_l3fwd_lookup_struct[socketid]);
-		printf("\nExisting NAT Rules : \n");
-		print_nat_rule();
+		populate_ipv6_few_flow_into_table(ipv6_l3fwd_lookup_struct[socketid],
+			first);
+		if (first) {
+			printf("\nExisting NAT Rules : \n");
+			print_nat_rule();
+		}
 	}
+
+	em_table_fill_histogram(ipv4_l3fwd_lookup_struct[socketid],
+		&ipv4_em_info[socketid]);
+	em_table_fill_histogram(ipv6_l3fwd_lookup_struct[socketid],
+		&ipv6_em_info[socketid]);
 }
 #endif
 
 #if (APP_LOOKUP_METHOD == APP_LOOKUP_LPM)
+/* Create the empty LPM tables of a socket */
 static void
-setup_lpm(int socketid)
+create_lpm(int socketid)
 {
 	struct rte_lpm6_config config;
-	unsigned i;
-	int ret;
 	char s[64];
 
 	/* create the LPM table */
@@ -1898,6 +5815,26 @@ setup_lpm(int socketid)
 		rte_exit(EXIT_FAILURE, "Unable to create the l3fwd LPM table"
 				" on socket %d\n", socketid);
 
+	/* create the LPM6 table */
+	rte_snprintf(s, sizeof(s), "IPV6_L3FWD_LPM_%d", socketid);
+	
+	config.max_rules = IPV6_L3FWD_LPM_MAX_RULES;
+	config.number_tbl8s = IPV6_L3FWD_LPM_NUMBER_TBL8S;
+	config.flags = 0;
+	ipv6_l3fwd_lookup_struct[socketid] = rte_lpm6_create(s, socketid,
+				&config);
+	if (ipv6_l3fwd_lookup_struct[socketid] == NULL)
+		rte_exit(EXIT_FAILURE, "Unable to create the l3fwd LPM table"
+				" on socket %d\n", socketid);
+}
+
+/* Populate the LPM tables of a socket */
+static void
+setup_lpm(int socketid, const int first)
+{
+	unsigned i;
+	int ret;
+
 	/* populate the LPM table */
 	for (i = 0; i < IPV4_L3FWD_NUM_ROUTES; i++) {
 		ret = rte_lpm_add(ipv4_l3fwd_lookup_struct[socketid],
@@ -1911,23 +5848,12 @@ setup_lpm(int socketid)
 				i, socketid);
 		}
 
-		printf("LPM: Adding route 0x%08x / %d (%d)\n",
-			(unsigned)ipv4_l3fwd_route_array[i].ip,
-			ipv4_l3fwd_route_array[i].depth,
-			ipv4_l3fwd_route_array[i].if_out);
+		if (first)
+			printf("LPM: Adding route 0x%08x / %d (%d)\n",
+				(unsigned)ipv4_l3fwd_route_array[i].ip,
+				ipv4_l3fwd_route_array[i].depth,
+				ipv4_l3fwd_route_array[i].if_out);
 	}
-	
-	/* create the LPM6 table */
-	rte_snprintf(s, sizeof(s), "IPV6_L3FWD_LPM_%d", socketid);
-	
-	config.max_rules = IPV6_L3FWD_LPM_MAX_RULES;
-	config.number_tbl8s = IPV6_L3FWD_LPM_NUMBER_TBL8S;
-	config.flags = 0;
-	ipv6_l3fwd_lookup_struct[socketid] = rte_lpm6_create(s, socketid,
-				&config);
-	if (ipv6_l3fwd_lookup_struct[socketid] == NULL)
-		rte_exit(EXIT_FAILURE, "Unable to create the l3fwd LPM table"
-				" on socket %d\n", socketid);
 
 	/* populate the LPM table */
 	for (i = 0; i < IPV6_L3FWD_NUM_ROUTES; i++) {
@@ -1942,21 +5868,339 @@ setup_lpm(int socketid)
 				i, socketid);
 		}
 
-		printf("LPM: Adding route %s / %d (%d)\n",
-			"IPV6",
-			ipv6_l3fwd_route_array[i].depth,
-			ipv6_l3fwd_route_array[i].if_out);
+		if (first)
+			printf("LPM: Adding route %s / %d (%d)\n",
+				"IPV6",
+				ipv6_l3fwd_route_array[i].depth,
+				ipv6_l3fwd_route_array[i].if_out);
+	}
+}
+#endif
+
+/* Bytes currently allocated from the hugepage heap of a socket */
+static uint64_t
+get_heap_alloc_size(int socketid)
+{
+	struct rte_malloc_socket_stats stats;
+
+	if (rte_malloc_get_socket_stats(socketid, &stats) < 0)
+		return 0;
+	return stats.heap_allocsz_bytes;
+}
+
+/*
+ * Socket whose build fills the arrays the tables of all sockets share and
+ * prints the routes, the others only add the keys to their own tables
+ */
+static int table_first_socket;
+
+/* Footprint and build time of the lookup tables of each socket */
+static struct {
+	uint64_t heap_size;
+	uint64_t cycles;
+	unsigned lcore_id;
+} table_build[NB_SOCKETS];
+
+/*
+ * Create the empty lookup tables of a socket. The master lcore does it
+ * before it launches the builds and allocates anything else, so that the
+ * growth of the socket's heap is the footprint of the tables alone.
+ */
+static void
+create_lookup_tables(int socketid)
+{
+	uint64_t start_tsc, heap_size;
+
+	heap_size = get_heap_alloc_size(socketid);
+	start_tsc = rte_rdtsc();
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_LPM)
+	create_lpm(socketid);
+#else
+	create_hash(socketid);
+#endif
+	table_build[socketid].heap_size =
+		get_heap_alloc_size(socketid) - heap_size;
+	table_build[socketid].cycles = rte_rdtsc() - start_tsc;
+}
+
+/* Populate one set of lookup tables and record its build time */
+static void
+setup_lookup_tables(int socketid)
+{
+	uint64_t start_tsc;
+
+	start_tsc = rte_rdtsc();
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_LPM)
+	setup_lpm(socketid, socketid == table_first_socket);
+#else
+	setup_hash(socketid, socketid == table_first_socket);
+#endif
+	table_build[socketid].cycles += rte_rdtsc() - start_tsc;
+	table_build[socketid].lcore_id = rte_lcore_id();
+}
+
+/* Report the lookup tables of a socket once every build is done */
+static void
+print_lookup_tables(int socketid)
+{
+	printf("Lookup tables on socket %d (%s): %"PRIu64" KB, built in "
+		"%"PRIu64" ms on lcore %u\n", socketid,
+		table_policy_name[table_policy],
+		table_build[socketid].heap_size >> 10,
+		table_build[socketid].cycles * MS_PER_S / rte_get_tsc_hz(),
+		table_build[socketid].lcore_id);
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+	print_em_table_info(ipv4_l3fwd_lookup_struct[socketid],
+		&ipv4_em_info[socketid]);
+	print_em_table_info(ipv6_l3fwd_lookup_struct[socketid],
+		&ipv6_em_info[socketid]);
+#endif
+}
+
+/* Socket whose lookup tables an lcore uses */
+static int
+table_socket_id(unsigned lcore_id)
+{
+	if (!numa_on)
+		return 0;
+	/* tables are shared from the master lcore's socket unless replicated */
+	if (table_policy != TABLE_POLICY_REPLICATED)
+		return rte_lcore_to_socket_id(rte_get_master_lcore());
+	return rte_lcore_to_socket_id(lcore_id);
+}
+
+/* lcore building the lookup tables of each socket, -1 if none are needed */
+static int table_lcore[NB_SOCKETS];
+
+static int
+build_lookup_tables(void *arg)
+{
+	setup_lookup_tables((int)(intptr_t)arg);
+	return 0;
+}
+
+/*
+ * Create the lookup tables of each socket some lcore uses and start
+ * populating them on a slave lcore of that socket, so that the sockets
+ * are built in parallel while the master lcore configures the ports. Only the build of the
+ * first of these sockets writes the arrays they share, see
+ * table_first_socket. The tables of a socket without a slave lcore to
+ * spare are built by the master lcore in wait_lookup_tables().
+ */
+static void
+start_lookup_tables(void)
+{
+	int busy[RTE_MAX_LCORE];
+	unsigned lcore_id;
+	int socketid, ret;
+
+	for (socketid = 0; socketid < NB_SOCKETS; socketid++)
+		table_lcore[socketid] = -1;
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		busy[lcore_id] = 0;
+		if (rte_lcore_is_enabled(lcore_id) == 0)
+			continue;
+		socketid = table_socket_id(lcore_id);
+		if (socketid >= NB_SOCKETS)
+			rte_exit(EXIT_FAILURE, "Socket %d of lcore %u is out of range"
+				" %d\n", socketid, lcore_id, NB_SOCKETS);
+		table_lcore[socketid] = rte_get_master_lcore();
+	}
+
+	for (socketid = 0; table_lcore[socketid] < 0; socketid++)
+		;
+	table_first_socket = socketid;
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
+	init_em_masks();
+#endif
+	for (socketid = 0; socketid < NB_SOCKETS; socketid++)
+		if (table_lcore[socketid] >= 0)
+			create_lookup_tables(socketid);
+
+	for (socketid = 0; socketid < NB_SOCKETS; socketid++) {
+		if (table_lcore[socketid] < 0)
+			continue;
+		RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+			if (busy[lcore_id] || (numa_on &&
+					(int)rte_lcore_to_socket_id(lcore_id) != socketid))
+				continue;
+			ret = rte_eal_remote_launch(build_lookup_tables,
+				(void *)(intptr_t)socketid, lcore_id);
+			if (ret < 0)
+				rte_exit(EXIT_FAILURE, "Cannot launch the table build"
+					" of socket %d on lcore %u\n", socketid, lcore_id);
+			table_lcore[socketid] = lcore_id;
+			busy[lcore_id] = 1;
+			break;
+		}
+	}
+}
+
+/* Wait for the lookup tables and hand them to the lcores */
+static void
+wait_lookup_tables(void)
+{
+	struct lcore_conf *qconf;
+	unsigned lcore_id;
+	int socketid;
+
+	for (socketid = 0; socketid < NB_SOCKETS; socketid++) {
+		if (table_lcore[socketid] < 0)
+			continue;
+		if (table_lcore[socketid] == (int)rte_get_master_lcore())
+			setup_lookup_tables(socketid);
+		else
+			rte_eal_wait_lcore(table_lcore[socketid]);
+	}
+	for (socketid = 0; socketid < NB_SOCKETS; socketid++)
+		if (table_lcore[socketid] >= 0)
+			print_lookup_tables(socketid);
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		if (rte_lcore_is_enabled(lcore_id) == 0)
+			continue;
+		socketid = table_socket_id(lcore_id);
+		qconf = &lcore_conf[lcore_id];
+		qconf->ipv4_lookup_struct = ipv4_l3fwd_lookup_struct[socketid];
+		qconf->ipv6_lookup_struct = ipv6_l3fwd_lookup_struct[socketid];
+	}
+}
+
+/*
+ * Size the mbuf data room: up to the max packet length, rounded to the
+ * 1KB granularity of the NIC receive buffers, so that each frame fits one
+ * mbuf and every packet can take the simple TX path. When --mbuf-seg-size
+ * caps it below that, longer frames are chained and sent on separate full
+ * featured TX queues.
+ */
+static void
+init_mbuf_size(void)
+{
+	uint32_t len = port_conf.rxmode.max_rx_pkt_len;
+
+	mbuf_data_size = RTE_ALIGN(len, 1024);
+	if (mbuf_seg_size != 0 && mbuf_seg_size < len) {
+		mbuf_data_size = mbuf_seg_size;
+		tx_mseg = 1;
+	}
+	printf("mbuf data room %u bytes, %s\n", mbuf_data_size, tx_mseg ?
+		"multi-segment frames use separate TX queues" :
+		"frames are received in one segment");
+}
+
+/* Socket the mbufs and descriptors of an RX queue are allocated on */
+static int
+rx_queue_socket_id(unsigned lcore_id, uint8_t portid)
+{
+	if (!numa_on)
+		return 0;
+	/* with --auto-config, rings and buffers are on the port's node */
+	if (auto_config && port_socket_id(portid) >= 0)
+		return port_socket_id(portid);
+	return rte_lcore_to_socket_id(lcore_id);
+}
+
+/* The mbuf pool an RX queue of a port fills */
+static struct rte_mempool *
+get_mbuf_pool(uint8_t portid, int socketid)
+{
+	return pktmbuf_pool[per_port_pool ? portid : SOCKET_POOL][socketid];
+}
+
+/*
+ * Mbufs a pool needs besides those its RX descriptors hold: a received
+ * packet may wait in any TX queue or ring whatever its input port, in the
+ * reorder stage, or in the TX buffers and bursts of an lcore, and each
+ * lcore caches up to 1.5 times MEMPOOL_CACHE_SIZE mbufs of every pool.
+ */
+static unsigned
+mbuf_pool_headroom(unsigned nb_ports)
+{
+	const struct lcore_conf *qconf;
+	unsigned lcore_id, portid, n, nb_tx_ports;
+
+	n = nb_worker_lcores * PIPELINE_RING_SIZE;
+	nb_tx_ports = 0;
+	for (portid = 0; portid < nb_ports; portid++) {
+		if ((enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		nb_tx_ports++;
+		n += port_n_tx_queue[portid] * nb_txd;
+		if (port_tx_ring[portid] != NULL || nb_tx_lcores != 0)
+			n += PIPELINE_RING_SIZE;
+	}
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		if (rte_lcore_is_enabled(lcore_id) == 0)
+			continue;
+		qconf = &lcore_conf[lcore_id];
+		n += (nb_tx_ports + 1) * MAX_PKT_BURST + MEMPOOL_CACHE_SIZE * 3 / 2;
+		if (reorder && qconf->role == LCORE_ROLE_RX)
+			n += REORDER_RING_SIZE + REORDER_WINDOW;
 	}
+	return n;
+}
+
+static void
+create_mbuf_pool(unsigned pool, int socketid, unsigned nb_mbuf)
+{
+	char s[64];
+
+	if (pool == SOCKET_POOL)
+		rte_snprintf(s, sizeof(s), "mbuf_pool_%d", socketid);
+	else
+		rte_snprintf(s, sizeof(s), "mbuf_pool_p%u_%d", pool, socketid);
+	pktmbuf_pool[pool][socketid] =
+		rte_mempool_create(s, nb_mbuf, MBUF_SIZE, MEMPOOL_CACHE_SIZE,
+			sizeof(struct rte_pktmbuf_pool_private),
+			rte_pktmbuf_pool_init, NULL,
+			rte_pktmbuf_init, NULL,
+			socketid, 0);
+	if (pktmbuf_pool[pool][socketid] == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot init mbuf pool %s on socket %d\n",
+			s, socketid);
+	printf("Allocated mbuf pool %s on socket %d: %u mbufs, %"PRIu64" KB\n",
+		s, socketid, nb_mbuf,
+		(uint64_t)nb_mbuf * MBUF_SIZE >> 10);
 }
-#endif
 
+/*
+ * Create the mbuf pools, once all the queues are known: each pool holds
+ * the RX descriptors of the queues it fills plus mbuf_pool_headroom(),
+ * and the flow caches of the lcores.
+ */
 static int
-init_mem(unsigned nb_mbuf)
+init_mem(unsigned nb_ports)
 {
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
 	struct lcore_conf *qconf;
+#endif
+	static unsigned nb_rx_desc[RTE_MAX_ETHPORTS + 1][NB_SOCKETS];
+	unsigned lcore_id, pool, headroom;
 	int socketid;
-	unsigned lcore_id;
-	char s[64];
+	uint16_t i;
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		for (i = 0; i < lcore_conf[lcore_id].n_rx_queue; i++) {
+			pool = lcore_conf[lcore_id].rx_queue_list[i].port_id;
+			socketid = rx_queue_socket_id(lcore_id, pool);
+			if (socketid >= NB_SOCKETS)
+				rte_exit(EXIT_FAILURE, "Socket %d of rx queues of port %u"
+					" is out of range %d\n", socketid, pool, NB_SOCKETS);
+			if (!per_port_pool)
+				pool = SOCKET_POOL;
+			nb_rx_desc[pool][socketid] += nb_rxd;
+		}
+	}
+
+	headroom = mbuf_pool_headroom(nb_ports);
+	for (pool = 0; pool <= SOCKET_POOL; pool++) {
+		for (socketid = 0; socketid < NB_SOCKETS; socketid++) {
+			if (nb_rx_desc[pool][socketid] != 0)
+				create_mbuf_pool(pool, socketid,
+					nb_rx_desc[pool][socketid] + headroom);
+		}
+	}
 
 	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
 		if (rte_lcore_is_enabled(lcore_id) == 0)
@@ -1971,86 +6215,485 @@ init_mem(unsigned nb_mbuf)
 			rte_exit(EXIT_FAILURE, "Socket %d of lcore %u is out of range %d\n",
 				socketid, lcore_id, NB_SOCKETS);
 		}
-		if (pktmbuf_pool[socketid] == NULL) {
-			rte_snprintf(s, sizeof(s), "mbuf_pool_%d", socketid);
-			pktmbuf_pool[socketid] =
-				rte_mempool_create(s, nb_mbuf, MBUF_SIZE, MEMPOOL_CACHE_SIZE,
-					sizeof(struct rte_pktmbuf_pool_private),
-					rte_pktmbuf_pool_init, NULL,
-					rte_pktmbuf_init, NULL,
-					socketid, 0);
-			if (pktmbuf_pool[socketid] == NULL)
-				rte_exit(EXIT_FAILURE,
-						"Cannot init mbuf pool on socket %d\n", socketid);
-			else
-				printf("Allocated mbuf pool on socket %d\n", socketid);
 
-#if (APP_LOOKUP_METHOD == APP_LOOKUP_LPM)
-			setup_lpm(socketid);
-#else
-			setup_hash(socketid);
-#endif
-		}
+#if (APP_LOOKUP_METHOD == APP_LOOKUP_EXACT_MATCH)
 		qconf = &lcore_conf[lcore_id];
-		qconf->ipv4_lookup_struct = ipv4_l3fwd_lookup_struct[socketid];
-		qconf->ipv6_lookup_struct = ipv6_l3fwd_lookup_struct[socketid];
+		if (table_policy == TABLE_POLICY_CACHED && qconf->ipv4_cache == NULL) {
+			qconf->ipv4_cache = rte_zmalloc_socket("ipv4_em_cache",
+				EM_CACHE_ENTRIES * EM_CACHE_ENTRY_SIZE(1),
+				CACHE_LINE_SIZE, socketid);
+			qconf->ipv6_cache = rte_zmalloc_socket("ipv6_em_cache",
+				EM_CACHE_ENTRIES *
+				EM_CACHE_ENTRY_SIZE(XMM_NUM_IN_IPV6_5TUPLE),
+				CACHE_LINE_SIZE, socketid);
+			if (qconf->ipv4_cache == NULL || qconf->ipv6_cache == NULL)
+				rte_exit(EXIT_FAILURE, "Cannot allocate flow cache for "
+					"lcore %u on socket %d\n", lcore_id, socketid);
+		}
+#endif
 	}
 	return 0;
 }
 
-/* Check the link status of all ports in up to 9s, and print them finally */
+/* Set up the RX queues of all the lcores, with nb_rxd descriptors */
+static void
+setup_rx_queues(int verbose)
+{
+	struct lcore_conf *qconf;
+	unsigned lcore_id;
+	uint8_t portid, queueid, socketid;
+	uint16_t queue;
+	int ret;
+
+	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+		if (rte_lcore_is_enabled(lcore_id) == 0)
+			continue;
+		qconf = &lcore_conf[lcore_id];
+		if (verbose) {
+			printf("\nInitializing rx queues on lcore %u ... ", lcore_id );
+			fflush(stdout);
+		}
+		/* init RX queues */
+		for(queue = 0; queue < qconf->n_rx_queue; ++queue) {
+			portid = qconf->rx_queue_list[queue].port_id;
+			queueid = qconf->rx_queue_list[queue].queue_id;
+
+			socketid = (uint8_t)rx_queue_socket_id(lcore_id, portid);
+
+			if (verbose) {
+				printf("rxq=%d,%d,%d ", portid, queueid, socketid);
+				fflush(stdout);
+			}
+
+			ret = rte_eth_rx_queue_setup(portid, queueid, nb_rxd,
+				        socketid, &rx_conf,
+				        get_mbuf_pool(portid, socketid));
+			if (ret < 0)
+				rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup: err=%d,"
+						"port=%d\n", ret, portid);
+		}
+	}
+}
+
+/* Set up the TX queues an lcore owns on a port, with nb_txd descriptors */
 static void
-check_all_ports_link_status(uint8_t port_num, uint32_t port_mask)
+setup_tx_queues(uint8_t portid, unsigned lcore_id, int verbose)
 {
+	const struct lcore_conf *qconf = &lcore_conf[lcore_id];
+	struct rte_eth_txconf mseg_conf = tx_conf;
+	uint8_t socketid;
+	int ret;
+
+	if (qconf->tx_queue_id[portid] == TX_QUEUE_SHARED)
+		return;
+
+	if (numa_on)
+		socketid = (uint8_t)rte_lcore_to_socket_id(lcore_id);
+	else
+		socketid = 0;
+
+	if (verbose) {
+		printf("txq=%u,%d,%d ", lcore_id, qconf->tx_queue_id[portid],
+			socketid);
+		fflush(stdout);
+	}
+	ret = rte_eth_tx_queue_setup(portid, qconf->tx_queue_id[portid], nb_txd,
+				     socketid, &tx_conf);
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup: err=%d, "
+			"port=%d\n", ret, portid);
+
+	if (!tx_mseg)
+		return;
+
+	mseg_conf.txq_flags &= ~ETH_TXQ_FLAGS_NOMULTSEGS;
+	if (verbose)
+		printf("txq=%u,%d,%d(mseg) ", lcore_id,
+			qconf->tx_mseg_queue_id[portid], socketid);
+	ret = rte_eth_tx_queue_setup(portid, qconf->tx_mseg_queue_id[portid],
+				     nb_txd, socketid, &mseg_conf);
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup: "
+			"err=%d, port=%d\n", ret, portid);
+}
+
+/*
+ * Report the link status of the ports from an EAL alarm, every 100ms until
+ * all links are up or 9s passed, so that the lcores need not wait for the
+ * slowest link to start forwarding.
+ */
 #define CHECK_INTERVAL 100 /* 100ms */
 #define MAX_CHECK_TIME 90 /* 9s (90 * 100ms) in total */
-	uint8_t portid, count, all_ports_up, print_flag = 0;
+
+static uint32_t link_wait_mask; /**< ports whose link is not up yet */
+static unsigned link_check_count;
+static uint64_t link_wait_tsc; /**< when the ports were started */
+
+static void
+check_link_status(__attribute__((unused)) void *arg)
+{
+	struct rte_eth_link link;
+	uint8_t portid;
+
+	for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
+		if ((link_wait_mask & (1 << portid)) == 0)
+			continue;
+		memset(&link, 0, sizeof(link));
+		rte_eth_link_get_nowait(portid, &link);
+		if (link.link_status == 0)
+			continue;
+		printf("Port %d Link Up - speed %u Mbps - %s, after %"PRIu64" ms\n",
+			portid, (unsigned)link.link_speed,
+			(link.link_duplex == ETH_LINK_FULL_DUPLEX) ?
+				"full-duplex" : "half-duplex",
+			(rte_rdtsc() - link_wait_tsc) * MS_PER_S / rte_get_tsc_hz());
+		link_wait_mask &= ~(1 << portid);
+	}
+	if (link_wait_mask == 0)
+		return;
+
+	if (++link_check_count > MAX_CHECK_TIME) {
+		for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
+			if (link_wait_mask & (1 << portid))
+				printf("Port %d Link Down\n", portid);
+		}
+		return;
+	}
+	if (rte_eal_alarm_set(CHECK_INTERVAL * 1000, check_link_status, NULL) < 0)
+		printf("Cannot check the link status again\n");
+}
+
+static void
+start_link_status_check(uint8_t port_num, uint32_t port_mask)
+{
+	link_wait_mask = port_mask & ((1ULL << port_num) - 1);
+	link_check_count = 0;
+	link_wait_tsc = rte_rdtsc();
+	check_link_status(NULL);
+}
+
+/*
+ * Candidate 0 of the ring calibration is the command line configuration.
+ * The ports are first set up with the largest candidate rings, so that
+ * the mbuf pools are sized for all of them.
+ */
+static void
+init_ring_calibration(void)
+{
+	unsigned i;
+
+	ring_calibration[0].nb_rxd = nb_rxd;
+	ring_calibration[0].rx_free_thresh = rx_conf.rx_free_thresh;
+	ring_calibration[0].nb_txd = nb_txd;
+	for (i = 1; i < NB_RING_CALIBRATION; i++) {
+		nb_rxd = RTE_MAX(nb_rxd, ring_calibration[i].nb_rxd);
+		nb_txd = RTE_MAX(nb_txd, ring_calibration[i].nb_txd);
+	}
+}
+
+/* Set up the queues of the stopped ports with a ring configuration */
+static void
+apply_ring_config(const struct ring_config *rc, unsigned nb_ports)
+{
+	unsigned lcore_id;
+	uint8_t portid;
+	int ret;
+
+	for (portid = 0; portid < nb_ports; portid++) {
+		if ((enabled_port_mask & (1 << portid)) != 0)
+			rte_eth_dev_stop(portid);
+	}
+
+	nb_rxd = rc->nb_rxd;
+	rx_conf.rx_free_thresh = rc->rx_free_thresh;
+	nb_txd = rc->nb_txd;
+	setup_rx_queues(0);
+
+	for (portid = 0; portid < nb_ports; portid++) {
+		if ((enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
+			if (rte_lcore_is_enabled(lcore_id))
+				setup_tx_queues(portid, lcore_id, 0);
+		}
+		ret = rte_eth_dev_start(portid);
+		if (ret < 0)
+			rte_exit(EXIT_FAILURE, "rte_eth_dev_start: err=%d, port=%d\n",
+				ret, portid);
+		if (promiscuous_on)
+			rte_eth_promiscuous_enable(portid);
+	}
+}
+
+/* Wait for the links of all the ports, as long as at startup */
+static int
+calibration_wait_link(unsigned nb_ports)
+{
 	struct rte_eth_link link;
+	unsigned count;
+	uint8_t portid;
+	int all_ports_up;
 
-	printf("\nChecking link status");
-	fflush(stdout);
 	for (count = 0; count <= MAX_CHECK_TIME; count++) {
 		all_ports_up = 1;
-		for (portid = 0; portid < port_num; portid++) {
-			if ((port_mask & (1 << portid)) == 0)
+		for (portid = 0; portid < nb_ports && all_ports_up; portid++) {
+			if ((enabled_port_mask & (1 << portid)) == 0)
 				continue;
 			memset(&link, 0, sizeof(link));
 			rte_eth_link_get_nowait(portid, &link);
-			/* print link status if flag set */
-			if (print_flag == 1) {
-				if (link.link_status)
-					printf("Port %d Link Up - speed %u "
-						"Mbps - %s\n", (uint8_t)portid,
-						(unsigned)link.link_speed,
-				(link.link_duplex == ETH_LINK_FULL_DUPLEX) ?
-					("full-duplex") : ("half-duplex\n"));
-				else
-					printf("Port %d Link Down\n",
-						(uint8_t)portid);
+			all_ports_up = link.link_status;
+		}
+		if (all_ports_up)
+			return 1;
+		rte_delay_ms(CHECK_INTERVAL);
+	}
+	return 0;
+}
+
+/*
+ * A 64 bytes UDP frame as the port would forward it, from a source
+ * address of the benchmarking range 198.18.0.0/15 that depends on flow.
+ */
+static void
+calibration_frame(struct rte_mbuf *m, uint8_t portid, uint32_t flow)
+{
+	struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(m, struct ether_hdr *);
+	struct ipv4_hdr *ipv4_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+	struct udp_hdr *udp_hdr = (struct udp_hdr *)(ipv4_hdr + 1);
+
+	memset(eth_hdr, 0, CALIBRATE_FRAME_LEN);
+	rewrite_l2_hdr(eth_hdr, portid);
+	eth_hdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+	ipv4_hdr->version_ihl = 0x45;
+	ipv4_hdr->total_length = rte_cpu_to_be_16(CALIBRATE_FRAME_LEN -
+		sizeof(struct ether_hdr));
+	ipv4_hdr->time_to_live = 64;
+	ipv4_hdr->next_proto_id = IPPROTO_UDP;
+	ipv4_hdr->src_addr = rte_cpu_to_be_32(IPv4(198,18,0,0) + flow);
+	ipv4_hdr->dst_addr = rte_cpu_to_be_32(IPv4(198,19,0,1));
+	ipv4_hdr->hdr_checksum = checksum(0, ipv4_hdr, sizeof(struct ipv4_hdr));
+
+	udp_hdr->src_port = rte_cpu_to_be_16(1024);
+	udp_hdr->dst_port = rte_cpu_to_be_16(1024);
+	udp_hdr->dgram_len = rte_cpu_to_be_16(CALIBRATE_FRAME_LEN -
+		sizeof(struct ether_hdr) - sizeof(struct ipv4_hdr));
+
+	m->pkt.data_len = CALIBRATE_FRAME_LEN;
+	m->pkt.pkt_len = CALIBRATE_FRAME_LEN;
+	m->pkt.nb_segs = 1;
+}
+
+/*
+ * Send synthetic frames out of TX queue 0 of every port for CALIBRATE_MS
+ * and receive from all the RX queues meanwhile. Returns the packets
+ * received, and sets the packets the NICs missed.
+ */
+static uint64_t
+calibration_run(unsigned nb_ports, struct rte_mempool *pool,
+	uint64_t *imissed)
+{
+	struct rte_mbuf *pkts[MAX_PKT_BURST];
+	struct rte_eth_stats stats;
+	uint64_t end_tsc, missed, rx = 0;
+	uint32_t flow = 0;
+	uint16_t i, n, sent;
+	uint8_t portid;
+
+	missed = 0;
+	for (portid = 0; portid < nb_ports; portid++) {
+		if ((enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		rte_eth_stats_get(portid, &stats);
+		missed -= stats.imissed;
+	}
+
+	end_tsc = rte_rdtsc() + rte_get_tsc_hz() * CALIBRATE_MS / MS_PER_S;
+	while (rte_rdtsc() < end_tsc) {
+		for (portid = 0; portid < nb_ports; portid++) {
+			if ((enabled_port_mask & (1 << portid)) == 0 ||
+					port_n_tx_queue[portid] == 0)
 				continue;
+			for (n = 0; n < MAX_PKT_BURST; n++) {
+				pkts[n] = rte_pktmbuf_alloc(pool);
+				if (pkts[n] == NULL)
+					break;
+				calibration_frame(pkts[n], portid, flow);
+				flow = (flow + 1) % CALIBRATE_FLOWS;
 			}
-			/* clear all_ports_up flag if any link down */
-			if (link.link_status == 0) {
-				all_ports_up = 0;
-				break;
-			}
+			sent = rte_eth_tx_burst(portid, 0, pkts, n);
+			if (sent < n)
+				free_pkts_bulk(pkts + sent, n - sent);
 		}
-		/* after finally printing all link status, get out */
-		if (print_flag == 1)
-			break;
+		for (i = 0; i < nb_lcore_params; i++) {
+			n = rte_eth_rx_burst(lcore_params[i].port_id,
+				lcore_params[i].queue_id, pkts, MAX_PKT_BURST);
+			free_pkts_bulk(pkts, n);
+			rx += n;
+		}
+	}
 
-		if (all_ports_up == 0) {
-			printf(".");
-			fflush(stdout);
-			rte_delay_ms(CHECK_INTERVAL);
+	for (portid = 0; portid < nb_ports; portid++) {
+		if ((enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		rte_eth_stats_get(portid, &stats);
+		missed += stats.imissed;
+	}
+	*imissed = missed;
+	return rx;
+}
+
+/*
+ * --calibrate-rings: measure each candidate of ring_calibration[] and set
+ * the ports up with the best one, see CALIBRATE_TOLERANCE. The command
+ * line configuration is kept when no frame came back.
+ */
+static void
+calibrate_rings_run(unsigned nb_ports)
+{
+	uint64_t rx[NB_RING_CALIBRATION], imissed[NB_RING_CALIBRATION];
+	struct rte_mempool *pool = NULL;
+	const struct ring_config *rc;
+	unsigned i, best, pool_idx;
+	uint64_t best_rx;
+	int socketid;
+
+	for (pool_idx = 0; pool_idx <= SOCKET_POOL && pool == NULL; pool_idx++) {
+		for (socketid = 0; socketid < NB_SOCKETS && pool == NULL; socketid++)
+			pool = pktmbuf_pool[pool_idx][socketid];
+	}
+	if (pool == NULL)
+		return;
+
+	best_rx = 0;
+	for (i = 0; i < NB_RING_CALIBRATION; i++) {
+		rc = &ring_calibration[i];
+		apply_ring_config(rc, nb_ports);
+		if (!calibration_wait_link(nb_ports))
+			RTE_LOG(INFO, L3FWD, "calibration: links are not all up\n");
+		rx[i] = calibration_run(nb_ports, pool, &imissed[i]);
+		RTE_LOG(INFO, L3FWD, "calibration: rxd %hu rx_free_thresh %hu"
+			" txd %hu: %"PRIu64" kpps, %"PRIu64" imissed\n", rc->nb_rxd,
+			rc->rx_free_thresh, rc->nb_txd,
+			rx[i] * MS_PER_S / CALIBRATE_MS / 1000, imissed[i]);
+		best_rx = RTE_MAX(best_rx, rx[i]);
+	}
+
+	best = 0;
+	if (best_rx == 0)
+		RTE_LOG(INFO, L3FWD, "calibration: no frame came back, keeping"
+			" the configured rings\n");
+	else {
+		for (i = 0; i < NB_RING_CALIBRATION; i++) {
+			if (rx[i] * 100 < best_rx * (100 - CALIBRATE_TOLERANCE))
+				continue;
+			if (rx[best] * 100 < best_rx * (100 - CALIBRATE_TOLERANCE) ||
+					imissed[i] < imissed[best])
+				best = i;
 		}
+	}
+
+	rc = &ring_calibration[best];
+	if (best != NB_RING_CALIBRATION - 1)
+		apply_ring_config(rc, nb_ports);
+	RTE_LOG(INFO, L3FWD, "rings calibrated: rxd %hu rx_free_thresh %hu"
+		" txd %hu\n", rc->nb_rxd, rc->rx_free_thresh, rc->nb_txd);
+}
+
+/* Startup phases, timed up to the launch of the lcores */
+enum startup_phase {
+	STARTUP_EAL,
+	STARTUP_PROBE,      /**< PCI probe and the checks of the configuration */
+	STARTUP_PORTS,      /**< mbuf pools, port and queue setup */
+	STARTUP_PORT_START,
+	STARTUP_CALIBRATION, /**< --calibrate-rings */
+	STARTUP_TABLES,     /**< waiting for the lookup tables */
+	STARTUP_PHASE_MAX
+};
+
+static const char *startup_phase_name[STARTUP_PHASE_MAX] = {
+	[STARTUP_EAL] = "eal",
+	[STARTUP_PROBE] = "probe",
+	[STARTUP_PORTS] = "ports",
+	[STARTUP_PORT_START] = "port start",
+	[STARTUP_CALIBRATION] = "calibration",
+	[STARTUP_TABLES] = "tables",
+};
+
+static uint64_t startup_tsc[STARTUP_PHASE_MAX];
+static uint64_t startup_phase_tsc; /**< when the current phase began */
+
+static void
+startup_phase_done(enum startup_phase phase)
+{
+	uint64_t now = rte_rdtsc();
+
+	startup_tsc[phase] = now - startup_phase_tsc;
+	startup_phase_tsc = now;
+}
+
+static void
+print_startup_times(void)
+{
+	uint64_t total = 0;
+	int i;
+
+	printf("Startup:");
+	for (i = 0; i < STARTUP_PHASE_MAX; i++) {
+		printf(" %s %"PRIu64" ms,", startup_phase_name[i],
+			startup_tsc[i] * MS_PER_S / rte_get_tsc_hz());
+		total += startup_tsc[i];
+	}
+	printf(" total %"PRIu64" ms\n", total * MS_PER_S / rte_get_tsc_hz());
+}
 
-		/* set the print_flag if all ports up or timeout */
-		if (all_ports_up == 1 || count == (MAX_CHECK_TIME - 1)) {
-			print_flag = 1;
-			printf("done\n");
+/*
+ * Hugepage memory of each socket, and how much of it the mbuf pools and
+ * the malloc heap, which holds the lookup tables, take. The rest goes to
+ * the NIC descriptor rings, the software rings and the free memory.
+ */
+static void
+print_memory_report(void)
+{
+	const struct rte_memseg *seg = rte_eal_get_physmem_layout();
+	const struct rte_mempool *mp;
+	struct rte_malloc_socket_stats heap;
+	uint64_t hugepages[NB_SOCKETS], pools[NB_SOCKETS];
+	unsigned i, pool, nb_pools[NB_SOCKETS];
+	int socketid;
+
+	for (socketid = 0; socketid < NB_SOCKETS; socketid++) {
+		hugepages[socketid] = 0;
+		pools[socketid] = 0;
+		nb_pools[socketid] = 0;
+	}
+	for (i = 0; i < RTE_MAX_MEMSEG && seg[i].addr != NULL; i++) {
+		if (seg[i].socket_id >= 0 && seg[i].socket_id < NB_SOCKETS)
+			hugepages[seg[i].socket_id] += seg[i].len;
+	}
+	for (pool = 0; pool <= SOCKET_POOL; pool++) {
+		for (socketid = 0; socketid < NB_SOCKETS; socketid++) {
+			mp = pktmbuf_pool[pool][socketid];
+			if (mp == NULL)
+				continue;
+			pools[socketid] += (uint64_t)mp->size *
+				(mp->header_size + mp->elt_size + mp->trailer_size);
+			nb_pools[socketid]++;
 		}
 	}
+
+	printf("Hugepage memory:\n");
+	for (socketid = 0; socketid < NB_SOCKETS; socketid++) {
+		if (hugepages[socketid] == 0)
+			continue;
+		memset(&heap, 0, sizeof(heap));
+		rte_malloc_get_socket_stats(socketid, &heap);
+		printf("socket %d: %"PRIu64" MB, %u mbuf pools %"PRIu64" MB,"
+			" malloc heap %"PRIu64" MB (%"PRIu64" MB in use)\n", socketid,
+			hugepages[socketid] >> 20, nb_pools[socketid],
+			pools[socketid] >> 20, (uint64_t)heap.heap_totalsz_bytes >> 20,
+			(uint64_t)heap.heap_allocsz_bytes >> 20);
+	}
 }
 
 int
@@ -2061,8 +6704,10 @@ MAIN(int argc, char **argv)
 	unsigned nb_ports;
 	uint16_t queueid;
 	unsigned lcore_id;
-	uint32_t n_tx_queue, nb_lcores;
-	uint8_t portid, nb_rx_queue, queue, socketid;
+	uint32_t n_tx_queue;
+	uint8_t portid, nb_rx_queue;
+
+	startup_phase_tsc = rte_rdtsc();
 
 	/* init EAL */
 	ret = rte_eal_init(argc, argv);
@@ -2070,19 +6715,17 @@ MAIN(int argc, char **argv)
 		rte_exit(EXIT_FAILURE, "Invalid EAL parameters\n");
 	argc -= ret;
 	argv += ret;
+	startup_phase_done(STARTUP_EAL);
 
 	/* parse application arguments (after the EAL ones) */
 	ret = parse_args(argc, argv);
 	if (ret < 0)
 		rte_exit(EXIT_FAILURE, "Invalid L3FWD parameters\n");
-
-	if (check_lcore_params() < 0)
-		rte_exit(EXIT_FAILURE, "check_lcore_params failed\n");
-
-	ret = init_lcore_rx_queues();
-	if (ret < 0)
-		rte_exit(EXIT_FAILURE, "init_lcore_rx_queues failed\n");
-
+	tx_retry_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S * tx_retry_us;
+	reorder_timeout_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S *
+		reorder_timeout_us;
+	if (calibrate_rings)
+		init_ring_calibration();
 
 	/* init driver(s) */
 	if (rte_pmd_init_all() < 0)
@@ -2095,10 +6738,42 @@ MAIN(int argc, char **argv)
 	if (nb_ports > RTE_MAX_ETHPORTS)
 		nb_ports = RTE_MAX_ETHPORTS;
 
+	if (auto_config)
+		auto_configure(nb_ports);
+
+	if (check_lcore_params() < 0)
+		rte_exit(EXIT_FAILURE, "check_lcore_params failed\n");
+
 	if (check_port_config(nb_ports) < 0)
 		rte_exit(EXIT_FAILURE, "check_port_config failed\n");
 
-	nb_lcores = rte_lcore_count();
+	ret = init_lcore_rx_queues();
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE, "init_lcore_rx_queues failed\n");
+
+	if (symmetric_rss) {
+		init_symmetric_rss();
+		port_conf.rx_adv_conf.rss_conf.rss_key = symmetric_rss_key;
+		check_symmetric_rss();
+	}
+
+	if (init_pipeline_roles() < 0)
+		rte_exit(EXIT_FAILURE, "init_pipeline_roles failed\n");
+
+	if (init_rebalance() < 0)
+		rte_exit(EXIT_FAILURE, "init_rebalance failed\n");
+
+	if (init_cpufreq() < 0)
+		rte_exit(EXIT_FAILURE, "init_cpufreq failed\n");
+
+	select_fwd_variants();
+
+	init_mbuf_size();
+
+	startup_phase_done(STARTUP_PROBE);
+
+	/* the lookup tables are built while the ports are initialized */
+	start_lookup_tables();
 
 	/* initialize all ports */
 	for (portid = 0; portid < nb_ports; portid++) {
@@ -2113,9 +6788,7 @@ MAIN(int argc, char **argv)
 		fflush(stdout);
 
 		nb_rx_queue = get_port_n_rx_queues(portid);
-		n_tx_queue = nb_lcores;
-		if (n_tx_queue > MAX_TX_QUEUE_PER_PORT)
-			n_tx_queue = MAX_TX_QUEUE_PER_PORT;
+		n_tx_queue = get_port_n_tx_queues(portid);
 		printf("Creating queues: nb_rxq=%d nb_txq=%u... ",
 			nb_rx_queue, (unsigned)n_tx_queue );
 		ret = rte_eth_dev_configure(portid, nb_rx_queue,
@@ -2126,68 +6799,49 @@ MAIN(int argc, char **argv)
 
 		rte_eth_macaddr_get(portid, &ports_eth_addr[portid]);
 		print_ethaddr(" Address:", &ports_eth_addr[portid]);
+		init_port_l2_hdr(portid);
 		printf(", ");
+		port_n_tx_queue[portid] = (uint16_t)n_tx_queue;
 
-		/* init memory */
-		ret = init_mem(NB_MBUF);
-		if (ret < 0)
-			rte_exit(EXIT_FAILURE, "init_mem failed\n");
-
-		/* init one TX queue per couple (lcore,port) */
+		/* init one TX queue per couple (lcore,port) while there are some */
 		queueid = 0;
 		for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
 			if (rte_lcore_is_enabled(lcore_id) == 0)
 				continue;
 
-			if (numa_on)
-				socketid = (uint8_t)rte_lcore_to_socket_id(lcore_id);
-			else
-				socketid = 0;
+			qconf = &lcore_conf[lcore_id];
+			qconf->tx_queue_id[portid] = TX_QUEUE_SHARED;
+			qconf->tx_port_id[qconf->n_tx_port++] = portid;
+			if (!lcore_sends(lcore_id))
+				continue;
 
-			printf("txq=%u,%d,%d ", lcore_id, queueid, socketid);
-			fflush(stdout);
-			ret = rte_eth_tx_queue_setup(portid, queueid, nb_txd,
-						     socketid, &tx_conf);
-			if (ret < 0)
-				rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup: err=%d, "
-					"port=%d\n", ret, portid);
+			if (queueid == n_tx_queue) {
+				share_tx_queues(portid, lcore_id);
+				continue;
+			}
 
-			qconf = &lcore_conf[lcore_id];
-			qconf->tx_queue_id[portid] = queueid;
-			queueid++;
+			if (queueid == 0)
+				tx_queue_owner[portid] = (uint8_t)lcore_id;
+			qconf->tx_queue_id[portid] = queueid++;
+			if (tx_mseg)
+				qconf->tx_mseg_queue_id[portid] = queueid++;
+			setup_tx_queues(portid, lcore_id, 1);
 		}
 		printf("\n");
 	}
 
-	for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; lcore_id++) {
-		if (rte_lcore_is_enabled(lcore_id) == 0)
-			continue;
-		qconf = &lcore_conf[lcore_id];
-		printf("\nInitializing rx queues on lcore %u ... ", lcore_id );
-		fflush(stdout);
-		/* init RX queues */
-		for(queue = 0; queue < qconf->n_rx_queue; ++queue) {
-			portid = qconf->rx_queue_list[queue].port_id;
-			queueid = qconf->rx_queue_list[queue].queue_id;
-
-			if (numa_on)
-				socketid = (uint8_t)rte_lcore_to_socket_id(lcore_id);
-			else
-				socketid = 0;
-
-			printf("rxq=%d,%d,%d ", portid, queueid, socketid);
-			fflush(stdout);
+	/* init memory, now that all the queues are known */
+	ret = init_mem(nb_ports);
+	if (ret < 0)
+		rte_exit(EXIT_FAILURE, "init_mem failed\n");
 
-			ret = rte_eth_rx_queue_setup(portid, queueid, nb_rxd,
-				        socketid, &rx_conf, pktmbuf_pool[socketid]);
-			if (ret < 0)
-				rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup: err=%d,"
-						"port=%d\n", ret, portid);
-		}
-	}
+	setup_rx_queues(1);
 
 	printf("\n");
 
+	init_pipeline_rings(nb_ports);
+	startup_phase_done(STARTUP_PORTS);
+
 	/* start ports */
 	for (portid = 0; portid < nb_ports; portid++) {
 		if ((enabled_port_mask & (1 << portid)) == 0) {
@@ -2209,7 +6863,24 @@ MAIN(int argc, char **argv)
 			rte_eth_promiscuous_enable(portid);
 	}
 
-	check_all_ports_link_status((uint8_t)nb_ports, enabled_port_mask);
+	start_link_status_check((uint8_t)nb_ports, enabled_port_mask);
+	startup_phase_done(STARTUP_PORT_START);
+
+	if (calibrate_rings)
+		calibrate_rings_run(nb_ports);
+	startup_phase_done(STARTUP_CALIBRATION);
+
+	init_reta(nb_ports);
+
+	wait_lookup_tables();
+	startup_phase_done(STARTUP_TABLES);
+	print_startup_times();
+	print_memory_report();
+
+	signal(SIGUSR1, signal_handler);
+	if (rte_eal_alarm_set(STATS_POLL_MS * 1000, stats_alarm, NULL) < 0)
+		rte_exit(EXIT_FAILURE, "Cannot set the statistics alarm\n");
+	printf("Send SIGUSR1 to dump statistics\n");
 
 	/* launch per-lcore init on every lcore */
 	rte_eal_mp_remote_launch(main_loop, NULL, CALL_MASTER);